@@ -1,5 +1,6 @@
-// release: gcc -O3 -Wall -o ./merge_sort ./merge_sort.c
-// debug  : gcc -g -Wall -o ./merge_sort_debug ./merge_sort.c
+// release: gcc -O3 -Wall -pthread -o ./merge_sort ./merge_sort.c
+// debug  : gcc -g -Wall -pthread -o ./merge_sort_debug ./merge_sort.c
+// the simd kernels are selected at runtime, no -march flag is needed
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,62 +9,2237 @@
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef uint32_t tuple_key_t;
 typedef uint32_t tuple_value_t;
 
-typedef struct  {
-    tuple_key_t   key;
-    tuple_value_t value;
-} tuple_t;
+typedef struct  {
+    tuple_key_t   key;
+    tuple_value_t value;
+} tuple_t;
+
+// merge sorted x[0, nx) and y[0, ny) into out
+void merge_runs_scalar(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    uint32_t i = 0;
+    uint32_t j = 0;
+    uint32_t k = 0;
+
+    while (i < nx && j < ny) {
+        if (x[i].key < y[j].key)
+            out[k++] = x[i++];
+        else
+            out[k++] = y[j++];
+    }
+
+    while (i < nx)
+        out[k++] = x[i++];
+
+    while (j < ny)
+        out[k++] = y[j++];
+}
+
+// same for packed key << 32 | row lanes, the row id breaks ties
+void merge_runs_scalar_u64(const uint64_t *x, uint32_t nx, const uint64_t *y, uint32_t ny, uint64_t *out) {
+    uint32_t i = 0;
+    uint32_t j = 0;
+    uint32_t k = 0;
+
+    while (i < nx && j < ny) {
+        if (x[i] < y[j])
+            out[k++] = x[i++];
+        else
+            out[k++] = y[j++];
+    }
+
+    while (i < nx)
+        out[k++] = x[i++];
+
+    while (j < ny)
+        out[k++] = y[j++];
+}
+
+/*
+ * simd base case: sort fixed-size blocks in registers before the merge passes
+ *
+ * a tuple is handled as one 64-bit lane, the halves are swapped on load so the
+ * key is the high word and the sign bit is flipped so signed 64-bit compares
+ * order the lanes by key. key and value always move together.
+ */
+
+#define SIMD_NONE   0
+#define SIMD_AVX2   1
+#define SIMD_AVX512 2
+
+#define SCALAR_BLOCK_TUPLES 16
+#define AVX2_BLOCK_TUPLES   16  // 4 registers x 4 tuples
+#define AVX512_BLOCK_TUPLES 64  // 8 registers x 8 tuples
+
+int simd_level = -1; // detected on first use
+
+int detect_simd_level(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_NONE;
+}
+
+static inline int get_simd_level(void) {
+    if (simd_level < 0)
+        simd_level = detect_simd_level();
+    return simd_level;
+}
+
+void insertion_sort(tuple_t *a, uint32_t len) {
+    for (uint32_t i = 1; i < len; i++) {
+        tuple_t t = a[i];
+        uint32_t j = i;
+        while (j > 0 && a[j - 1].key > t.key) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = t;
+    }
+}
+
+void insertion_sort_u64(uint64_t *a, uint32_t len) {
+    for (uint32_t i = 1; i < len; i++) {
+        uint64_t t = a[i];
+        uint32_t j = i;
+        while (j > 0 && a[j - 1] > t) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = t;
+    }
+}
+
+#if defined(__x86_64__)
+
+#define AVX2_TARGET   __attribute__((target("avx2,popcnt")))
+#define AVX512_TARGET __attribute__((target("avx512f,popcnt")))
+
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+
+// packed lanes already hold the key in the high word and skip the swap
+static inline AVX2_TARGET __m256i avx2_load(const void *p, bool packed) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    if (!packed)
+        v = _mm256_shuffle_epi32(v, 0xB1);
+    return _mm256_xor_si256(v, _mm256_set1_epi64x(INT64_MIN));
+}
+
+static inline AVX2_TARGET void avx2_store(void *p, __m256i v, bool packed) {
+    v = _mm256_xor_si256(v, _mm256_set1_epi64x(INT64_MIN));
+    if (!packed)
+        v = _mm256_shuffle_epi32(v, 0xB1);
+    _mm256_storeu_si256((__m256i *)p, v);
+}
+
+static inline AVX2_TARGET void avx2_minmax(__m256i *a, __m256i *b) {
+    __m256i gt = _mm256_cmpgt_epi64(*a, *b);
+    __m256i mn = _mm256_blendv_epi8(*a, *b, gt);
+    *b = _mm256_blendv_epi8(*b, *a, gt);
+    *a = mn;
+}
+
+// one compare-exchange step between lanes at distance 1 (0xB1) or 2 (0x4E),
+// lanes selected by the epi32 blend mask take the max
+#define AVX2_STEP(v, perm, mask) do {                 \
+        __m256i __p = _mm256_permute4x64_epi64(v, perm); \
+        __m256i __mn = v;                                \
+        avx2_minmax(&__mn, &__p);                        \
+        v = _mm256_blend_epi32(__mn, __p, mask);         \
+    } while (0)
+
+static inline AVX2_TARGET __m256i avx2_sort_reg(__m256i v) {
+    AVX2_STEP(v, 0xB1, 0x3C);
+    AVX2_STEP(v, 0x4E, 0xF0);
+    AVX2_STEP(v, 0xB1, 0xCC);
+    return v;
+}
+
+// bitonic register to ascending
+static inline AVX2_TARGET __m256i avx2_clean_reg(__m256i v) {
+    AVX2_STEP(v, 0x4E, 0xF0);
+    AVX2_STEP(v, 0xB1, 0xCC);
+    return v;
+}
+
+static inline AVX2_TARGET __m256i avx2_reverse(__m256i v) {
+    return _mm256_permute4x64_epi64(v, 0x1B);
+}
+
+// a and b sorted, on return a holds the lower and b the upper half
+static inline AVX2_TARGET void avx2_merge_regs(__m256i *a, __m256i *b) {
+    *b = avx2_reverse(*b);
+    avx2_minmax(a, b);
+    *a = avx2_clean_reg(*a);
+    *b = avx2_clean_reg(*b);
+}
+
+static ALWAYS_INLINE AVX2_TARGET void avx2_sort_block(void *p, bool packed) {
+    uint64_t *a = p;
+    __m256i r[4];
+    for (int i = 0; i < 4; i++)
+        r[i] = avx2_sort_reg(avx2_load(&a[i * 4], packed));
+
+    // merge sorted register groups of g into groups of 2g
+    for (int g = 1; g < 4; g <<= 1) {
+        for (int base = 0; base < 4; base += g << 1) {
+            for (int i = 0; i < g; i++)
+                r[base + g + i] = avx2_reverse(r[base + g + i]);
+            for (int i = 0; i < g / 2; i++) {
+                __m256i t = r[base + g + i];
+                r[base + g + i] = r[base + (g << 1) - 1 - i];
+                r[base + (g << 1) - 1 - i] = t;
+            }
+            for (int d = g; d >= 1; d >>= 1)
+                for (int i = base; i < base + (g << 1); i++)
+                    if (((i - base) & d) == 0)
+                        avx2_minmax(&r[i], &r[i + d]);
+            for (int i = base; i < base + (g << 1); i++)
+                r[i] = avx2_clean_reg(r[i]);
+        }
+    }
+
+    for (int i = 0; i < 4; i++)
+        avx2_store(&a[i * 4], r[i], packed);
+}
+
+void AVX2_TARGET sort_block_avx2(tuple_t *a) {
+    avx2_sort_block(a, false);
+}
+
+void AVX2_TARGET sort_block_avx2_u64(uint64_t *a) {
+    avx2_sort_block(a, true);
+}
+
+static inline AVX512_TARGET __m512i avx512_load(const void *p, bool packed) {
+    __m512i v = _mm512_loadu_si512(p);
+    return packed ? v : _mm512_ror_epi64(v, 32);
+}
+
+static inline AVX512_TARGET void avx512_store(void *p, __m512i v, bool packed) {
+    _mm512_storeu_si512(p, packed ? v : _mm512_ror_epi64(v, 32));
+}
+
+static inline AVX512_TARGET void avx512_minmax(__m512i *a, __m512i *b) {
+    __m512i mn = _mm512_min_epu64(*a, *b);
+    *b = _mm512_max_epu64(*a, *b);
+    *a = mn;
+}
+
+// lanes selected by mask take the max of the pair at distance 1, 2 or 4
+static inline AVX512_TARGET __m512i avx512_step1(__m512i v, __mmask8 m) {
+    __m512i p = _mm512_shuffle_epi32(v, _MM_PERM_BADC);
+    return _mm512_mask_blend_epi64(m, _mm512_min_epu64(v, p), _mm512_max_epu64(v, p));
+}
+
+static inline AVX512_TARGET __m512i avx512_step2(__m512i v, __mmask8 m) {
+    __m512i p = _mm512_permutex_epi64(v, 0x4E);
+    return _mm512_mask_blend_epi64(m, _mm512_min_epu64(v, p), _mm512_max_epu64(v, p));
+}
+
+static inline AVX512_TARGET __m512i avx512_step4(__m512i v, __mmask8 m) {
+    __m512i p = _mm512_shuffle_i64x2(v, v, 0x4E);
+    return _mm512_mask_blend_epi64(m, _mm512_min_epu64(v, p), _mm512_max_epu64(v, p));
+}
+
+static inline AVX512_TARGET __m512i avx512_sort_reg(__m512i v) {
+    v = avx512_step1(v, 0x66);
+    v = avx512_step2(v, 0x3C);
+    v = avx512_step1(v, 0x5A);
+    v = avx512_step4(v, 0xF0);
+    v = avx512_step2(v, 0xCC);
+    return avx512_step1(v, 0xAA);
+}
+
+static inline AVX512_TARGET __m512i avx512_clean_reg(__m512i v) {
+    v = avx512_step4(v, 0xF0);
+    v = avx512_step2(v, 0xCC);
+    return avx512_step1(v, 0xAA);
+}
+
+static inline AVX512_TARGET __m512i avx512_reverse(__m512i v) {
+    return _mm512_permutexvar_epi64(_mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7), v);
+}
+
+static inline AVX512_TARGET void avx512_merge_regs(__m512i *a, __m512i *b) {
+    *b = avx512_reverse(*b);
+    avx512_minmax(a, b);
+    *a = avx512_clean_reg(*a);
+    *b = avx512_clean_reg(*b);
+}
+
+static ALWAYS_INLINE AVX512_TARGET void avx512_sort_block(void *p, bool packed) {
+    uint64_t *a = p;
+    __m512i r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = avx512_sort_reg(avx512_load(&a[i * 8], packed));
+
+    for (int g = 1; g < 8; g <<= 1) {
+        for (int base = 0; base < 8; base += g << 1) {
+            for (int i = 0; i < g; i++)
+                r[base + g + i] = avx512_reverse(r[base + g + i]);
+            for (int i = 0; i < g / 2; i++) {
+                __m512i t = r[base + g + i];
+                r[base + g + i] = r[base + (g << 1) - 1 - i];
+                r[base + (g << 1) - 1 - i] = t;
+            }
+            for (int d = g; d >= 1; d >>= 1)
+                for (int i = base; i < base + (g << 1); i++)
+                    if (((i - base) & d) == 0)
+                        avx512_minmax(&r[i], &r[i + d]);
+            for (int i = base; i < base + (g << 1); i++)
+                r[i] = avx512_clean_reg(r[i]);
+        }
+    }
+
+    for (int i = 0; i < 8; i++)
+        avx512_store(&a[i * 8], r[i], packed);
+}
+
+void AVX512_TARGET sort_block_avx512(tuple_t *a) {
+    avx512_sort_block(a, false);
+}
+
+void AVX512_TARGET sort_block_avx512_u64(uint64_t *a) {
+    avx512_sort_block(a, true);
+}
+
+/*
+ * bitonic merge kernels, both runs need at least one register of tuples
+ *
+ * the upper half of the last merge stays in a register and is merged with the
+ * next register loaded from the run with the smaller head. once a run has less
+ * than a register left, the pending register and the short tail are merged in
+ * a small buffer which is then merged with the rest of the long run.
+ */
+
+static void merge_tail(const tuple_t *pend, uint32_t npend,
+                       const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    tuple_t buf[AVX512_BLOCK_TUPLES];
+    const tuple_t *shorter = x, *longer = y;
+    uint32_t nshort = nx, nlong = ny;
+
+    if (nx > ny) {
+        shorter = y;
+        longer = x;
+        nshort = ny;
+        nlong = nx;
+    }
+
+    assert(npend + nshort <= AVX512_BLOCK_TUPLES);
+    merge_runs_scalar(pend, npend, shorter, nshort, buf);
+    merge_runs_scalar(buf, npend + nshort, longer, nlong, out);
+}
+
+static void merge_tail_u64(const uint64_t *pend, uint32_t npend,
+                           const uint64_t *x, uint32_t nx, const uint64_t *y, uint32_t ny, uint64_t *out) {
+    uint64_t buf[AVX512_BLOCK_TUPLES];
+    const uint64_t *shorter = x, *longer = y;
+    uint32_t nshort = nx, nlong = ny;
+
+    if (nx > ny) {
+        shorter = y;
+        longer = x;
+        nshort = ny;
+        nlong = nx;
+    }
+
+    assert(npend + nshort <= AVX512_BLOCK_TUPLES);
+    merge_runs_scalar_u64(pend, npend, shorter, nshort, buf);
+    merge_runs_scalar_u64(buf, npend + nshort, longer, nlong, out);
+}
+
+// the key that orders lane i, the whole lane when packed
+static inline uint64_t lane_key(const uint64_t *a, uint32_t i, bool packed) {
+    return packed ? a[i] : ((const tuple_t *)a)[i].key;
+}
+
+static inline void merge_tail_lanes(const uint64_t *pend, uint32_t npend, const uint64_t *x, uint32_t nx,
+                                    const uint64_t *y, uint32_t ny, uint64_t *out, bool packed) {
+    if (packed)
+        merge_tail_u64(pend, npend, x, nx, y, ny, out);
+    else
+        merge_tail((const tuple_t *)pend, npend, (const tuple_t *)x, nx, (const tuple_t *)y, ny, (tuple_t *)out);
+}
+
+static ALWAYS_INLINE AVX2_TARGET void avx2_merge_runs(const void *px, uint32_t nx, const void *py, uint32_t ny,
+                                                      void *pout, bool packed) {
+    const uint64_t *x = px, *y = py;
+    uint64_t *out = pout;
+    __m256i lo = avx2_load(x, packed);
+    __m256i hi = avx2_load(y, packed);
+    uint32_t i = 4, j = 4, k = 4;
+    uint64_t pend[4];
+
+    avx2_merge_regs(&lo, &hi);
+    avx2_store(out, lo, packed);
+
+    while (i + 4 <= nx && j + 4 <= ny) {
+        if (lane_key(x, i, packed) < lane_key(y, j, packed)) {
+            lo = avx2_load(&x[i], packed);
+            i += 4;
+        }
+        else {
+            lo = avx2_load(&y[j], packed);
+            j += 4;
+        }
+        avx2_merge_regs(&lo, &hi);
+        avx2_store(&out[k], lo, packed);
+        k += 4;
+    }
+
+    avx2_store(pend, hi, packed);
+    merge_tail_lanes(pend, 4, &x[i], nx - i, &y[j], ny - j, &out[k], packed);
+}
+
+void AVX2_TARGET merge_runs_avx2(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    avx2_merge_runs(x, nx, y, ny, out, false);
+}
+
+void AVX2_TARGET merge_runs_avx2_u64(const uint64_t *x, uint32_t nx, const uint64_t *y, uint32_t ny, uint64_t *out) {
+    avx2_merge_runs(x, nx, y, ny, out, true);
+}
+
+static ALWAYS_INLINE AVX512_TARGET void avx512_merge_runs(const void *px, uint32_t nx, const void *py, uint32_t ny,
+                                                          void *pout, bool packed) {
+    const uint64_t *x = px, *y = py;
+    uint64_t *out = pout;
+    __m512i lo = avx512_load(x, packed);
+    __m512i hi = avx512_load(y, packed);
+    uint32_t i = 8, j = 8, k = 8;
+    uint64_t pend[8];
+
+    avx512_merge_regs(&lo, &hi);
+    avx512_store(out, lo, packed);
+
+    while (i + 8 <= nx && j + 8 <= ny) {
+        if (lane_key(x, i, packed) < lane_key(y, j, packed)) {
+            lo = avx512_load(&x[i], packed);
+            i += 8;
+        }
+        else {
+            lo = avx512_load(&y[j], packed);
+            j += 8;
+        }
+        avx512_merge_regs(&lo, &hi);
+        avx512_store(&out[k], lo, packed);
+        k += 8;
+    }
+
+    avx512_store(pend, hi, packed);
+    merge_tail_lanes(pend, 8, &x[i], nx - i, &y[j], ny - j, &out[k], packed);
+}
+
+void AVX512_TARGET merge_runs_avx512(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    avx512_merge_runs(x, nx, y, ny, out, false);
+}
+
+void AVX512_TARGET merge_runs_avx512_u64(const uint64_t *x, uint32_t nx, const uint64_t *y, uint32_t ny, uint64_t *out) {
+    avx512_merge_runs(x, nx, y, ny, out, true);
+}
+
+#endif
+
+void merge_runs(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    switch (get_simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        if (nx >= 8 && ny >= 8) {
+            merge_runs_avx512(x, nx, y, ny, out);
+            return;
+        }
+        break;
+    case SIMD_AVX2:
+        if (nx >= 4 && ny >= 4) {
+            merge_runs_avx2(x, nx, y, ny, out);
+            return;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    merge_runs_scalar(x, nx, y, ny, out);
+}
+
+void merge(tuple_t *a, uint32_t left, uint32_t mid, uint32_t right, tuple_t *tmp) {
+    merge_runs(&a[left], mid - left, &a[mid], right - mid, &tmp[left]);
+}
+
+// sort every block of a in place, returns the width of the sorted runs
+uint32_t sort_blocks(tuple_t *a, uint32_t len) {
+    uint32_t block = SCALAR_BLOCK_TUPLES;
+    uint32_t i = 0;
+
+    switch (get_simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        block = AVX512_BLOCK_TUPLES;
+        for (; i + block <= len; i += block)
+            sort_block_avx512(&a[i]);
+        break;
+    case SIMD_AVX2:
+        block = AVX2_BLOCK_TUPLES;
+        for (; i + block <= len; i += block)
+            sort_block_avx2(&a[i]);
+        break;
+#endif
+    default:
+        for (; i + block <= len; i += block)
+            insertion_sort(&a[i], block);
+        break;
+    }
+
+    if (i < len)
+        insertion_sort(&a[i], len - i);
+
+    return block;
+}
+
+void merge_runs_u64(const uint64_t *x, uint32_t nx, const uint64_t *y, uint32_t ny, uint64_t *out) {
+    switch (get_simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        if (nx >= 8 && ny >= 8) {
+            merge_runs_avx512_u64(x, nx, y, ny, out);
+            return;
+        }
+        break;
+    case SIMD_AVX2:
+        if (nx >= 4 && ny >= 4) {
+            merge_runs_avx2_u64(x, nx, y, ny, out);
+            return;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    merge_runs_scalar_u64(x, nx, y, ny, out);
+}
+
+uint32_t sort_blocks_u64(uint64_t *a, uint32_t len) {
+    uint32_t block = SCALAR_BLOCK_TUPLES;
+    uint32_t i = 0;
+
+    switch (get_simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        block = AVX512_BLOCK_TUPLES;
+        for (; i + block <= len; i += block)
+            sort_block_avx512_u64(&a[i]);
+        break;
+    case SIMD_AVX2:
+        block = AVX2_BLOCK_TUPLES;
+        for (; i + block <= len; i += block)
+            sort_block_avx2_u64(&a[i]);
+        break;
+#endif
+    default:
+        for (; i + block <= len; i += block)
+            insertion_sort_u64(&a[i], block);
+        break;
+    }
+
+    if (i < len)
+        insertion_sort_u64(&a[i], len - i);
+
+    return block;
+}
+
+// bytes read plus bytes written by the sort passes over memory
+uint64_t sort_bytes = 0;
+
+static inline void count_bytes(uint64_t tuples) {
+    __atomic_fetch_add(&sort_bytes, tuples * 2 * sizeof(tuple_t), __ATOMIC_RELAXED);
+}
+
+#if 0 // change algo method
+
+// recursive
+void __merge_sort(tuple_t *a, uint32_t left, uint32_t right, tuple_t *tmp) {
+    uint32_t mid;
+    if (left < right - 1) {
+        mid = (right + left) >> 1;
+        __merge_sort(a, left, mid, tmp);
+        __merge_sort(a, mid, right, tmp);
+        merge(a, left, mid, right, tmp);
+        memcpy(a + left, tmp + left, sizeof(tuple_t) * (right - left));
+    }
+}
+
+static inline void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
+    __merge_sort(a, 0, len, tmp);
+}
+
+#else
+
+// bottom-up merge passes over sorted runs of width, returns the passes made
+uint32_t merge_passes(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t width) {
+    uint32_t toggle = 0;
+    tuple_t *src, *dst;
+    for (; width < len; width <<= 1) {
+        if (toggle & 1) {
+            src = tmp;
+            dst = a;
+        }
+        else {
+            src = a;
+            dst = tmp;
+        }
+        //clock_t t = clock();
+        for (uint32_t i = 0; i < len; i += (width << 1)) {
+            uint32_t mid = i + width;
+            if (mid > len)
+                mid = len;
+
+            uint32_t right = mid + width;
+            if (right > len)
+                right = len;
+
+            merge(src, i, mid, right, dst);
+        }
+        //t = clock() - t;
+        //printf("width: %d, time: %f ms\n", width, (float)t * 1000 / CLOCKS_PER_SEC);
+        toggle++;
+    }
+
+    if (toggle & 1) {
+        memcpy(a, tmp, len * sizeof(tuple_t));
+        toggle++;
+    }
+
+    return toggle;
+}
+
+// non-recursive
+void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
+    if (len <= 1)
+        return;
+
+    uint32_t passes = merge_passes(a, len, tmp, sort_blocks(a, len));
+    count_bytes((uint64_t)len * (passes + 1));
+}
+
+#endif
+
+/*
+ * parallel merge sort
+ *
+ * every thread sorts one chunk, then each pass merges pairs of runs. the output
+ * of a pass is cut into equal slices, one per thread, and merge path (co-rank)
+ * search finds where a slice starts in both input runs, so even the last merge
+ * of two huge runs is spread over all threads.
+ */
+
+// number of tuples taken from x among the first k outputs of merging x and y
+uint32_t merge_path(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, uint32_t k) {
+    uint32_t lo = k > ny ? k - ny : 0;
+    uint32_t hi = k < nx ? k : nx;
+
+    while (lo < hi) {
+        uint32_t i = lo + ((hi - lo) >> 1);
+        uint32_t j = k - i;
+        if (i < nx && j > 0 && y[j - 1].key > x[i].key)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return lo;
+}
+
+// produce outputs [k0, k1) of merging x and y into out[k0, k1)
+void merge_runs_range(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny,
+                      tuple_t *out, uint32_t k0, uint32_t k1) {
+    uint32_t i0 = merge_path(x, nx, y, ny, k0);
+    uint32_t i1 = merge_path(x, nx, y, ny, k1);
+
+    merge_runs(&x[i0], i1 - i0, &y[k0 - i0], (k1 - i1) - (k0 - i0), &out[k0]);
+}
+
+typedef struct {
+    tuple_t *a;
+    tuple_t *tmp;
+    uint32_t len;
+    uint32_t thread_num;
+    pthread_barrier_t barrier;
+} par_sort_ctx_t;
+
+typedef struct {
+    par_sort_ctx_t *ctx;
+    uint32_t id;
+    pthread_t thread;
+} par_sort_arg_t;
+
+static inline uint32_t slice_begin(uint32_t len, uint32_t id, uint32_t num) {
+    return (uint32_t)((uint64_t)len * id / num);
+}
+
+void *merge_sort_worker(void *arg) {
+    par_sort_arg_t *par = arg;
+    par_sort_ctx_t *ctx = par->ctx;
+    uint32_t num = ctx->thread_num;
+    uint32_t len = ctx->len;
+    uint32_t k0 = slice_begin(len, par->id, num);
+    uint32_t k1 = slice_begin(len, par->id + 1, num);
+
+    // every thread keeps its own copy of the run boundaries
+    uint32_t run[num + 1];
+    uint32_t run_num = num;
+    for (uint32_t i = 0; i <= num; i++)
+        run[i] = slice_begin(len, i, num);
+
+    merge_sort(&ctx->a[k0], k1 - k0, &ctx->tmp[k0]);
+
+    tuple_t *src = ctx->a, *dst = ctx->tmp;
+    while (run_num > 1) {
+        pthread_barrier_wait(&ctx->barrier);
+
+        for (uint32_t p = 0; p < run_num; p += 2) {
+            uint32_t left = run[p];
+            uint32_t mid = run[p + 1];
+            uint32_t right = p + 1 < run_num ? run[p + 2] : mid; // odd run out
+            uint32_t lo = k0 > left ? k0 : left;
+            uint32_t hi = k1 < right ? k1 : right;
+
+            if (lo >= hi)
+                continue;
+
+            if (mid == right)
+                memcpy(&dst[lo], &src[lo], (hi - lo) * sizeof(tuple_t));
+            else
+                merge_runs_range(&src[left], mid - left, &src[mid], right - mid,
+                                 &dst[left], lo - left, hi - left);
+        }
+        count_bytes(k1 - k0);
+
+        uint32_t next = 0;
+        for (uint32_t p = 0; p < run_num; p += 2)
+            run[next++] = run[p];
+        run[next] = len;
+        run_num = next;
+
+        tuple_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    pthread_barrier_wait(&ctx->barrier);
+    if (src != ctx->a && k0 < k1) {
+        memcpy(&ctx->a[k0], &src[k0], (k1 - k0) * sizeof(tuple_t));
+        count_bytes(k1 - k0);
+    }
+
+    return NULL;
+}
+
+void merge_sort_parallel(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t thread_num) {
+    if (thread_num <= 1 || len < thread_num * AVX512_BLOCK_TUPLES) {
+        merge_sort(a, len, tmp);
+        return;
+    }
+
+    get_simd_level(); // detect before the threads race on it
+
+    par_sort_ctx_t ctx = {.a = a, .tmp = tmp, .len = len, .thread_num = thread_num};
+    par_sort_arg_t args[thread_num];
+    pthread_barrier_init(&ctx.barrier, NULL, thread_num);
+
+    for (uint32_t i = 0; i < thread_num; i++) {
+        args[i].ctx = &ctx;
+        args[i].id = i;
+        int ret = pthread_create(&args[i].thread, NULL, merge_sort_worker, &args[i]);
+        assert(ret == 0);
+    }
+
+    for (uint32_t i = 0; i < thread_num; i++)
+        pthread_join(args[i].thread, NULL);
+
+    pthread_barrier_destroy(&ctx.barrier);
+}
+
+/*
+ * adaptive natural merge sort
+ *
+ * existing ascending runs are detected and strictly descending runs are
+ * reversed in place, then only those runs are merged. when one run keeps
+ * winning the merge gallops: exponential then binary search for the end of the
+ * winning stretch, which is copied in one go. inputs with short runs are handed
+ * to merge_sort() as soon as that is apparent, so shuffled data loses nothing.
+ */
+
+#define NATURAL_MIN_RUN 32  // average run length below which runs are not worth it
+#define MIN_GALLOP      7
+
+// number of leading tuples of x with key <= key (or < key when strict)
+uint32_t gallop(const tuple_t *x, uint32_t n, tuple_key_t key, bool strict) {
+    uint32_t lo = 0, hi = 1;
+
+    while (hi < n && (strict ? x[hi - 1].key < key : x[hi - 1].key <= key)) {
+        lo = hi;
+        hi <<= 1;
+    }
+    if (hi > n)
+        hi = n;
+
+    while (lo < hi) {
+        uint32_t m = lo + ((hi - lo) >> 1);
+        if (strict ? x[m].key < key : x[m].key <= key)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+void merge_runs_gallop(const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny, tuple_t *out) {
+    uint32_t i = 0, j = 0, k = 0;
+    uint32_t win_x = 0, win_y = 0;
+
+    while (i < nx && j < ny) {
+        if (y[j].key < x[i].key) {
+            out[k++] = y[j++];
+            win_x = 0;
+            if (++win_y >= MIN_GALLOP && j < ny) {
+                uint32_t n = gallop(&y[j], ny - j, x[i].key, true);
+                memcpy(&out[k], &y[j], n * sizeof(tuple_t));
+                j += n;
+                k += n;
+                win_y = 0;
+            }
+        }
+        else {
+            out[k++] = x[i++];
+            win_y = 0;
+            if (++win_x >= MIN_GALLOP && i < nx) {
+                uint32_t n = gallop(&x[i], nx - i, y[j].key, false);
+                memcpy(&out[k], &x[i], n * sizeof(tuple_t));
+                i += n;
+                k += n;
+                win_x = 0;
+            }
+        }
+    }
+
+    memcpy(&out[k], &x[i], (nx - i) * sizeof(tuple_t));
+    k += nx - i;
+    memcpy(&out[k], &y[j], (ny - j) * sizeof(tuple_t));
+}
+
+static void reverse_tuples(tuple_t *a, uint32_t len) {
+    for (uint32_t i = 0, j = len - 1; i < j; i++, j--) {
+        tuple_t t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+// returns the number of runs found, 0 once the runs turn out to be too short
+uint32_t find_runs(tuple_t *a, uint32_t len, uint32_t *run, uint32_t max_runs) {
+    uint32_t run_num = 0;
+    uint32_t i = 0;
+
+    while (i < len) {
+        uint32_t j = i + 1;
+        if (j < len && a[j].key < a[i].key) {
+            while (j < len && a[j].key < a[j - 1].key)
+                j++;
+            reverse_tuples(&a[i], j - i);
+        }
+        else {
+            while (j < len && a[j].key >= a[j - 1].key)
+                j++;
+        }
+
+        run[run_num++] = i;
+        i = j;
+
+        if (run_num == max_runs || (run_num > 8 && run_num * NATURAL_MIN_RUN > i))
+            return 0;
+    }
+
+    run[run_num] = len;
+    return run_num;
+}
+
+void merge_sort_natural(tuple_t *a, uint32_t len, tuple_t *tmp) {
+    if (len <= 1)
+        return;
+
+    uint32_t max_runs = len / NATURAL_MIN_RUN + 16;
+    uint32_t *run = malloc((max_runs + 1) * sizeof(uint32_t));
+    assert(run != NULL);
+
+    uint32_t run_num = find_runs(a, len, run, max_runs);
+    count_bytes(len);
+    if (run_num == 0) {
+        free(run);
+        merge_sort(a, len, tmp);
+        return;
+    }
+
+    tuple_t *src = a, *dst = tmp;
+    while (run_num > 1) {
+        uint32_t next = 0;
+        for (uint32_t p = 0; p < run_num; p += 2) {
+            uint32_t left = run[p];
+            uint32_t mid = run[p + 1];
+            if (p + 1 == run_num)
+                memcpy(&dst[left], &src[left], (mid - left) * sizeof(tuple_t));
+            else
+                merge_runs_gallop(&src[left], mid - left, &src[mid], run[p + 2] - mid, &dst[left]);
+            run[next++] = left;
+        }
+        run[next] = len;
+        run_num = next;
+        count_bytes(len);
+
+        tuple_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != a) {
+        memcpy(a, src, len * sizeof(tuple_t));
+        count_bytes(len);
+    }
+
+    free(run);
+}
+
+/*
+ * k-way merge sort with a loser tree
+ *
+ * cache-sized runs are sorted in cache first, then every pass merges up to
+ * fanin runs at once, so the data streams through memory about
+ * 1 + log_fanin(len / run) times instead of log2(len) times.
+ */
+
+#define KWAY_RUN_BYTES (1 << 20)
+#define KWAY_RUN_TUPLES ((uint32_t)(KWAY_RUN_BYTES / sizeof(tuple_t)))
+#define KEY_EXHAUSTED  UINT64_MAX
+
+typedef struct {
+    uint32_t leaf_num;      // power of two
+    uint32_t *node;         // node[0] is the winner, node[1, leaf_num) the losers
+    uint64_t *key;          // head key of every leaf, KEY_EXHAUSTED once empty
+    const tuple_t **cur;
+    const tuple_t **end;
+} loser_tree_t;
+
+void init_loser_tree(loser_tree_t *lt, uint32_t fanin) {
+    uint32_t leaf_num = 1;
+    while (leaf_num < fanin)
+        leaf_num <<= 1;
+
+    lt->leaf_num = leaf_num;
+    lt->node = malloc(leaf_num * sizeof(uint32_t));
+    lt->key = malloc(leaf_num * sizeof(uint64_t));
+    lt->cur = malloc(leaf_num * sizeof(tuple_t *));
+    lt->end = malloc(leaf_num * sizeof(tuple_t *));
+    assert(lt->node != NULL && lt->key != NULL && lt->cur != NULL && lt->end != NULL);
+}
+
+void destroy_loser_tree(loser_tree_t *lt) {
+    free(lt->node);
+    free(lt->key);
+    free(lt->cur);
+    free(lt->end);
+}
+
+// attach the runs and play the initial tournament
+void build_loser_tree(loser_tree_t *lt, const tuple_t **begin, const tuple_t **end, uint32_t run_num) {
+    uint32_t leaf_num = lt->leaf_num;
+
+    for (uint32_t i = 0; i < leaf_num; i++) {
+        lt->cur[i] = i < run_num ? begin[i] : NULL;
+        lt->end[i] = i < run_num ? end[i] : NULL;
+        lt->key[i] = i < run_num && begin[i] < end[i] ? begin[i]->key : KEY_EXHAUSTED;
+    }
+
+    // w[n] is the winner of the subtree rooted at n, leaves at leaf_num + i
+    uint32_t w[leaf_num * 2];
+    for (uint32_t i = 0; i < leaf_num; i++)
+        w[leaf_num + i] = i;
+    for (uint32_t n = leaf_num - 1; n >= 1; n--) {
+        uint32_t l = w[n * 2], r = w[n * 2 + 1];
+        if (lt->key[r] < lt->key[l]) {
+            w[n] = r;
+            lt->node[n] = l;
+        }
+        else {
+            w[n] = l;
+            lt->node[n] = r;
+        }
+    }
+    lt->node[0] = leaf_num > 1 ? w[1] : 0;
+}
+
+// pop the winner and replay its path to the root
+static inline tuple_t loser_tree_pop(loser_tree_t *lt) {
+    uint32_t win = lt->node[0];
+    tuple_t t = *lt->cur[win]++;
+
+    lt->key[win] = lt->cur[win] < lt->end[win] ? lt->cur[win]->key : KEY_EXHAUSTED;
+    for (uint32_t n = (win + lt->leaf_num) >> 1; n >= 1; n >>= 1) {
+        if (lt->key[lt->node[n]] < lt->key[win]) {
+            uint32_t t = lt->node[n];
+            lt->node[n] = win;
+            win = t;
+        }
+    }
+    lt->node[0] = win;
+
+    return t;
+}
+
+// merge the sorted runs src[run[i], run[i + 1]) for i < run_num into dst
+void merge_kway(const tuple_t *src, const uint32_t *run, uint32_t run_num, tuple_t *dst, loser_tree_t *lt) {
+    const tuple_t *begin[run_num], *end[run_num];
+    for (uint32_t i = 0; i < run_num; i++) {
+        begin[i] = &src[run[i]];
+        end[i] = &src[run[i + 1]];
+    }
+
+    // one or two runs do not need the tree
+    if (run_num == 1) {
+        memcpy(&dst[run[0]], begin[0], (run[1] - run[0]) * sizeof(tuple_t));
+        return;
+    }
+    if (run_num == 2) {
+        merge_runs(begin[0], run[1] - run[0], begin[1], run[2] - run[1], &dst[run[0]]);
+        return;
+    }
+
+    build_loser_tree(lt, begin, end, run_num);
+    for (uint32_t k = run[0]; k < run[run_num]; k++)
+        dst[k] = loser_tree_pop(lt);
+}
+
+// kway merge passes over sorted runs of width, the result ends up in a
+void merge_kway_passes(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t width, uint32_t fanin) {
+    loser_tree_t lt;
+    init_loser_tree(&lt, fanin);
+
+    uint32_t run[fanin + 1];
+    tuple_t *src = a, *dst = tmp;
+    for (uint64_t w = width; w < len; w *= fanin) {
+        for (uint64_t g = 0; g < len; g += w * fanin) {
+            uint32_t run_num = 0;
+            for (uint64_t off = g; off < len && run_num < fanin; off += w)
+                run[run_num++] = (uint32_t)off;
+            run[run_num] = g + w * fanin < len ? (uint32_t)(g + w * fanin) : len;
+            merge_kway(src, run, run_num, dst, &lt);
+        }
+        count_bytes(len);
+
+        tuple_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != a) {
+        memcpy(a, src, len * sizeof(tuple_t));
+        count_bytes(len);
+    }
+
+    destroy_loser_tree(&lt);
+}
+
+void merge_sort_kway(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t fanin) {
+    assert(fanin >= 2);
+    if (len <= 1)
+        return;
+
+    // the runs are sorted in cache, only one read and one write reach memory
+    uint64_t bytes = sort_bytes;
+    for (uint32_t i = 0; i < len; i += KWAY_RUN_TUPLES) {
+        uint32_t n = len - i < KWAY_RUN_TUPLES ? len - i : KWAY_RUN_TUPLES;
+        merge_sort(&a[i], n, &tmp[i]);
+    }
+    sort_bytes = bytes;
+    count_bytes(len);
+
+    merge_kway_passes(a, len, tmp, KWAY_RUN_TUPLES, fanin);
+}
+
+/*
+ * cache-conscious sort driven by the detected cache sizes
+ *
+ * the input is processed one llc-sized group at a time: l1-sized chunks are
+ * sorted, merged into l2-sized blocks and those into the group, all while the
+ * group stays in the llc. a final kway merge streams the groups once more.
+ * half of every level is left for the tmp buffer.
+ */
+
+typedef struct {
+    uint64_t l1;
+    uint64_t l2;
+    uint64_t llc;
+} cache_sizes_t;
+
+cache_sizes_t cache_sizes;
+
+#define TWOPHASE_FANIN 64
+
+// size of the data or unified cache of the given level from sysfs, 0 if unknown
+uint64_t sysfs_cache_size(uint32_t level) {
+    char path[128], buf[32];
+
+    for (uint32_t index = 0; ; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/level", index);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            return 0;
+        uint32_t l = fgets(buf, sizeof(buf), f) ? (uint32_t)atoi(buf) : 0;
+        fclose(f);
+        if (l != level)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/type", index);
+        f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        bool data = fgets(buf, sizeof(buf), f) && strncmp(buf, "Instruction", 11) != 0;
+        fclose(f);
+        if (!data)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/size", index);
+        f = fopen(path, "r");
+        if (f == NULL)
+            return 0;
+        char *unit = NULL;
+        uint64_t size = fgets(buf, sizeof(buf), f) ? strtoull(buf, &unit, 10) : 0;
+        fclose(f);
+        if (unit != NULL && *unit == 'K')
+            size <<= 10;
+        else if (unit != NULL && *unit == 'M')
+            size <<= 20;
+        return size;
+    }
+}
+
+static uint64_t cache_size(int name, uint32_t level) {
+    long size = sysconf(name);
+    return size > 0 ? (uint64_t)size : sysfs_cache_size(level);
+}
+
+void detect_cache_sizes(cache_sizes_t *cs) {
+    cs->l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 1);
+    cs->l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 2);
+    cs->llc = cache_size(_SC_LEVEL3_CACHE_SIZE, 3);
+
+    // conservative defaults for whatever could not be detected
+    if (cs->l1 == 0)
+        cs->l1 = 32 << 10;
+    if (cs->l2 == 0)
+        cs->l2 = 256 << 10;
+    if (cs->llc == 0)
+        cs->llc = cs->l2 > (8 << 20) ? cs->l2 : 8 << 20;
+}
+
+void merge_sort_twophase(tuple_t *a, uint32_t len, tuple_t *tmp) {
+    if (len <= 1)
+        return;
+    if (cache_sizes.l1 == 0)
+        detect_cache_sizes(&cache_sizes);
+
+    // every level holds a whole number of the level below
+    uint32_t chunk = cache_sizes.l1 / 2 / sizeof(tuple_t);
+    if (chunk < AVX512_BLOCK_TUPLES)
+        chunk = AVX512_BLOCK_TUPLES;
+    uint32_t block = cache_sizes.l2 / 2 / sizeof(tuple_t) / chunk * chunk;
+    if (block < chunk)
+        block = chunk;
+    uint64_t group_tuples = cache_sizes.llc / 2 / sizeof(tuple_t) / block * block;
+    uint32_t group = group_tuples > len ? len : (group_tuples < block ? block : (uint32_t)group_tuples);
+
+    uint64_t bytes = sort_bytes;
+    for (uint32_t g = 0; g < len; g += group) {
+        uint32_t ng = len - g < group ? len - g : group;
+        for (uint32_t b = g; b < g + ng; b += block) {
+            uint32_t nb = g + ng - b < block ? g + ng - b : block;
+            for (uint32_t c = b; c < b + nb; c += chunk)
+                merge_sort(&a[c], b + nb - c < chunk ? b + nb - c : chunk, &tmp[c]);
+            merge_passes(&a[b], nb, &tmp[b], chunk);
+        }
+        merge_passes(&a[g], ng, &tmp[g], block);
+    }
+    sort_bytes = bytes;
+    count_bytes(len); // the groups were sorted inside the llc
+
+    merge_kway_passes(a, len, tmp, group, TWOPHASE_FANIN);
+}
+
+/*
+ * lsd radix sort on the 32-bit key
+ *
+ * one pass over the input builds the histograms of all digits, digits where
+ * every key falls into the same bucket are skipped. the scatter goes through
+ * one cache line buffer per bucket (software write-combining) so the output is
+ * written a full line at a time.
+ */
+
+#define SWWC_TUPLES (64 / sizeof(tuple_t))
+
+typedef struct {
+    tuple_t t[SWWC_TUPLES];
+} __attribute__((aligned(64))) swwc_line_t;
+
+// offset holds 2 * buckets entries, the write positions and the bucket starts
+void radix_scatter(const tuple_t *src, uint32_t len, tuple_t *dst, uint32_t shift, uint32_t mask,
+                   const uint32_t *hist, uint32_t *offset, swwc_line_t *line) {
+    uint32_t buckets = mask + 1;
+    uint32_t *start = &offset[buckets];
+    uint32_t sum = 0;
+
+    for (uint32_t b = 0; b < buckets; b++) {
+        start[b] = offset[b] = sum;
+        sum += hist[b];
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t b = (src[i].key >> shift) & mask;
+        uint32_t pos = offset[b]++;
+        uint32_t slot = pos & (SWWC_TUPLES - 1);
+
+        line[b].t[slot] = src[i];
+        if (slot == SWWC_TUPLES - 1) {
+            if (pos + 1 - start[b] >= SWWC_TUPLES)
+                memcpy(&dst[pos + 1 - SWWC_TUPLES], line[b].t, sizeof(swwc_line_t));
+            else // first line of the bucket starts in the middle
+                memcpy(&dst[start[b]], &line[b].t[start[b] & (SWWC_TUPLES - 1)],
+                       (pos + 1 - start[b]) * sizeof(tuple_t));
+        }
+    }
+
+    // flush the partially filled lines
+    for (uint32_t b = 0; b < buckets; b++) {
+        uint32_t end = offset[b];
+        uint32_t begin = end & ~(uint32_t)(SWWC_TUPLES - 1);
+        if (begin < start[b])
+            begin = start[b];
+        if (begin < end)
+            memcpy(&dst[begin], &line[b].t[begin & (SWWC_TUPLES - 1)], (end - begin) * sizeof(tuple_t));
+    }
+}
+
+void radix_sort(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t digit_bits) {
+    assert(digit_bits == 8 || digit_bits == 11);
+    if (len <= 1)
+        return;
+
+    uint32_t buckets = 1U << digit_bits;
+    uint32_t mask = buckets - 1;
+    uint32_t digits = (sizeof(tuple_key_t) * 8 + digit_bits - 1) / digit_bits;
+
+    uint32_t *hist = calloc(digits * buckets, sizeof(uint32_t));
+    uint32_t *offset = malloc(2 * buckets * sizeof(uint32_t));
+    swwc_line_t *line = aligned_alloc(64, buckets * sizeof(swwc_line_t));
+    assert(hist != NULL && offset != NULL && line != NULL);
+
+    for (uint32_t i = 0; i < len; i++) {
+        tuple_key_t key = a[i].key;
+        for (uint32_t d = 0; d < digits; d++)
+            hist[d * buckets + ((key >> (d * digit_bits)) & mask)]++;
+    }
+    sort_bytes += (uint64_t)len * sizeof(tuple_t); // the histogram pass only reads
+
+    tuple_t *src = a, *dst = tmp;
+    for (uint32_t d = 0; d < digits; d++) {
+        uint32_t shift = d * digit_bits;
+        uint32_t *h = &hist[d * buckets];
+
+        if (h[(src[0].key >> shift) & mask] == len)
+            continue; // all keys share this digit
+
+        radix_scatter(src, len, dst, shift, mask, h, offset, line);
+        count_bytes(len);
+
+        tuple_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != a) {
+        memcpy(a, src, len * sizeof(tuple_t));
+        count_bytes(len);
+    }
+
+    free(hist);
+    free(offset);
+    free(line);
+}
+
+/*
+ * materializing merge join
+ *
+ * result pairs are written into a caller supplied batch buffer, when it fills
+ * up the flush callback consumes the batch and the buffer is reused, so the
+ * whole result never has to be in memory at once. equal key groups on both
+ * sides produce their full cross product.
+ */
+
+#define JOIN_BATCH_PAIRS (32 * 1024 / sizeof(join_pair_t)) // about one l1d
+
+typedef struct {
+    tuple_value_t r;
+    tuple_value_t s;
+} join_pair_t;
+
+typedef void (*join_flush_t)(const join_pair_t *pairs, uint32_t num, void *ctx);
+
+typedef struct {
+    join_pair_t *buf;
+    uint32_t     cap;
+    uint32_t     num;
+    join_flush_t flush;
+    void        *ctx;
+} join_sink_t;
+
+void init_join_sink(join_sink_t *sink, join_pair_t *buf, uint32_t cap, join_flush_t flush, void *ctx) {
+    assert(buf != NULL && cap > 0 && flush != NULL);
+    sink->buf = buf;
+    sink->cap = cap;
+    sink->num = 0;
+    sink->flush = flush;
+    sink->ctx = ctx;
+}
+
+void flush_join_sink(join_sink_t *sink) {
+    if (sink->num > 0)
+        sink->flush(sink->buf, sink->num, sink->ctx);
+    sink->num = 0;
+}
+
+static inline void join_sink_put(join_sink_t *sink, tuple_value_t r, tuple_value_t s) {
+    sink->buf[sink->num].r = r;
+    sink->buf[sink->num].s = s;
+    if (++sink->num == sink->cap)
+        flush_join_sink(sink);
+}
+
+// emit the cross product of the equal key groups starting at r[*i] and s[*j],
+// then move both past their group
+static inline uint64_t join_group(const tuple_t *r, uint32_t num_r, const tuple_t *s, uint32_t num_s,
+                                  uint32_t *i, uint32_t *j, join_sink_t *sink) {
+    uint32_t ie = *i + 1, je = *j + 1;
+    while (ie < num_r && r[ie].key == r[*i].key)
+        ie++;
+    while (je < num_s && s[je].key == s[*j].key)
+        je++;
+
+    if (sink != NULL) {
+        for (uint32_t x = *i; x < ie; x++)
+            for (uint32_t y = *j; y < je; y++)
+                join_sink_put(sink, r[x].value, s[y].value);
+    }
+
+    uint64_t matches = (uint64_t)(ie - *i) * (je - *j);
+    *i = ie;
+    *j = je;
+    return matches;
+}
+
+// join sorted r and s, the pairs go to sink unless it is NULL, returns the number of
+// matches. the sink is flushed before returning.
+uint64_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, join_sink_t *sink) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
+
+    while (i < num_r && j < num_s) {
+        if (r[i].key < s[j].key)
+            i++;
+        else if (r[i].key > s[j].key)
+            j++;
+        else
+            matches += join_group(r, num_r, s, num_s, &i, &j, sink);
+    }
+
+    if (sink != NULL)
+        flush_join_sink(sink);
+
+    return matches;
+}
+
+/*
+ * adaptive join strategies
+ *
+ * when one input is much smaller most of the larger one never matches, so the
+ * galloping join skips ahead with exponential then binary search (gallop())
+ * instead of stepping. for a smaller size gap the simd join compares the next 8
+ * keys against the other head at once and skips the whole block when they are
+ * all smaller. inputs of about the same size interleave tightly and keep the
+ * plain merge join.
+ */
+
+#define JOIN_MERGE  0
+#define JOIN_GALLOP 1
+#define JOIN_SIMD   2
+#define JOIN_MIXED  3 // parallel join threads picked different strategies
+
+// larger / smaller input size that switches strategy
+#define JOIN_SIMD_RATIO   4
+#define JOIN_GALLOP_RATIO 32
+
+const char *join_name[] = {"merge", "gallop", "simd", "mixed"};
+
+uint64_t merge_join_gallop(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, join_sink_t *sink) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
+
+    while (i < num_r && j < num_s) {
+        if (r[i].key < s[j].key)
+            i += gallop(&r[i], num_r - i, s[j].key, true);
+        else if (r[i].key > s[j].key)
+            j += gallop(&s[j], num_s - j, r[i].key, true);
+        else
+            matches += join_group(r, num_r, s, num_s, &i, &j, sink);
+    }
+
+    if (sink != NULL)
+        flush_join_sink(sink);
+
+    return matches;
+}
+
+#if defined(__x86_64__)
+
+// number of leading tuples of x with a key below key, 8 keys per compare. the
+// keys are the even 32-bit lanes and the sign flip makes the signed compare
+// unsigned, the lanes below key are a prefix of the sorted block
+static inline AVX2_TARGET uint32_t skip_less_avx2(const tuple_t *x, uint32_t n, tuple_key_t key) {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&x[i]), sign);
+        __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&x[i + 4]), sign);
+        uint32_t m0 = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v0)));
+        uint32_t m1 = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v1)));
+        uint32_t m = (m0 | m1 << 8) & 0x5555;
+        if (m != 0x5555)
+            return i + __builtin_ctz(~m & 0x5555) / 2;
+    }
+
+    while (i < n && x[i].key < key)
+        i++;
+
+    return i;
+}
+
+// interleaved inputs mostly advance by one, the block compare only starts when
+// the same side is behind for a second step
+uint64_t AVX2_TARGET merge_join_simd(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, join_sink_t *sink) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
+
+    while (i < num_r && j < num_s) {
+        if (r[i].key < s[j].key) {
+            if (++i < num_r && r[i].key < s[j].key)
+                i += skip_less_avx2(&r[i], num_r - i, s[j].key);
+        }
+        else if (r[i].key > s[j].key) {
+            if (++j < num_s && s[j].key < r[i].key)
+                j += skip_less_avx2(&s[j], num_s - j, r[i].key);
+        }
+        else
+            matches += join_group(r, num_r, s, num_s, &i, &j, sink);
+    }
+
+    if (sink != NULL)
+        flush_join_sink(sink);
+
+    return matches;
+}
+
+#endif
+
+int pick_join_strategy(uint32_t num_r, uint32_t num_s) {
+    uint32_t lo = num_r < num_s ? num_r : num_s;
+    uint32_t hi = num_r < num_s ? num_s : num_r;
+
+    if (lo == 0)
+        return JOIN_MERGE;
+    if (hi / lo >= JOIN_GALLOP_RATIO)
+        return JOIN_GALLOP;
+    if (hi / lo >= JOIN_SIMD_RATIO && get_simd_level() >= SIMD_AVX2)
+        return JOIN_SIMD;
+    return JOIN_MERGE;
+}
+
+// join with the strategy picked from the input sizes, returned in strategy if not NULL
+uint64_t merge_join_adaptive(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s,
+                             join_sink_t *sink, int *strategy) {
+    int pick = pick_join_strategy(num_r, num_s);
+
+    if (strategy != NULL)
+        *strategy = pick;
+
+    switch (pick) {
+    case JOIN_GALLOP:
+        return merge_join_gallop(r, s, num_r, num_s, sink);
+#if defined(__x86_64__)
+    case JOIN_SIMD:
+        return merge_join_simd(r, s, num_r, num_s, sink);
+#endif
+    default:
+        return merge_join(r, s, num_r, num_s, sink);
+    }
+}
+
+/*
+ * parallel merge join
+ *
+ * the merged order of r and s is cut into equal slices with merge path, then
+ * every cut is moved back to the first tuple of its key in both inputs so no
+ * equal key group is split between two segment pairs. every thread joins one
+ * pair into its own sink.
+ */
+
+// first tuples of r and s at or after output k of merging them, aligned to a key group
+void join_split(const tuple_t *r, uint32_t num_r, const tuple_t *s, uint32_t num_s, uint32_t k,
+                uint32_t *ri, uint32_t *si) {
+    if (k >= num_r + num_s) {
+        *ri = num_r;
+        *si = num_s;
+        return;
+    }
+
+    uint32_t i = merge_path(r, num_r, s, num_s, k);
+    uint32_t j = k - i;
+    tuple_key_t key = (j >= num_s || (i < num_r && r[i].key <= s[j].key)) ? r[i].key : s[j].key;
+
+    *ri = gallop(r, num_r, key, true);
+    *si = gallop(s, num_s, key, true);
+}
+
+typedef struct {
+    tuple_t *r;
+    tuple_t *s;
+    uint32_t num_r;
+    uint32_t num_s;
+    join_sink_t *sink;
+    uint64_t matches;
+    int strategy;
+    pthread_t thread;
+} par_join_arg_t;
+
+void *merge_join_worker(void *arg) {
+    par_join_arg_t *par = arg;
+    par->matches = merge_join_adaptive(par->r, par->s, par->num_r, par->num_s, par->sink, &par->strategy);
+    return NULL;
+}
+
+// sinks holds one sink per thread, or is NULL to only count. the strategy the
+// threads used is returned in strategy if not NULL, JOIN_MIXED if they differ
+uint64_t merge_join_parallel(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s,
+                             uint32_t thread_num, join_sink_t *sinks, int *strategy) {
+    if (thread_num <= 1)
+        return merge_join_adaptive(r, s, num_r, num_s, sinks, strategy);
+
+    get_simd_level(); // detect before the threads race on it
+
+    uint32_t len = num_r + num_s;
+    uint32_t ri[thread_num + 1], si[thread_num + 1];
+    for (uint32_t i = 0; i <= thread_num; i++)
+        join_split(r, num_r, s, num_s, slice_begin(len, i, thread_num), &ri[i], &si[i]);
+
+    par_join_arg_t args[thread_num];
+    for (uint32_t i = 0; i < thread_num; i++) {
+        args[i].r = &r[ri[i]];
+        args[i].s = &s[si[i]];
+        args[i].num_r = ri[i + 1] - ri[i];
+        args[i].num_s = si[i + 1] - si[i];
+        args[i].sink = sinks != NULL ? &sinks[i] : NULL;
+        int ret = pthread_create(&args[i].thread, NULL, merge_join_worker, &args[i]);
+        assert(ret == 0);
+    }
+
+    uint64_t matches = 0;
+    int used = -1;
+    for (uint32_t i = 0; i < thread_num; i++) {
+        pthread_join(args[i].thread, NULL);
+        matches += args[i].matches;
+        if (args[i].num_r + args[i].num_s == 0)
+            continue; // empty slice, joined nothing
+        if (used < 0)
+            used = args[i].strategy;
+        else if (used != args[i].strategy)
+            used = JOIN_MIXED;
+    }
+
+    if (strategy != NULL)
+        *strategy = used < 0 ? JOIN_MERGE : used;
+    return matches;
+}
+
+/*
+ * fused last merge pass and join
+ *
+ * both relations are sorted down to two runs only, the last pass of each is a
+ * stream that merges the next STREAM_TUPLES outputs into a small buffer when
+ * the join pulls past its end. merge path finds where a batch starts in both
+ * runs, so every batch still goes through the simd merge kernels. the sorted
+ * relations are never written back or read again by the join.
+ */
+
+#define STREAM_TUPLES 512 // 4KB batch, stays in l1
+
+typedef struct {
+    const tuple_t *x;
+    const tuple_t *y;
+    uint32_t nx;
+    uint32_t ny;
+    uint32_t k;   // outputs merged so far
+    uint32_t i;   // of which from x
+    uint32_t pos;
+    uint32_t num;
+    tuple_t buf[STREAM_TUPLES];
+} merge_stream_t;
+
+// merge passes until at most two runs are left, returns the buffer holding
+// them, the second one starts at *mid
+tuple_t *sort_to_two_runs(tuple_t *a, uint32_t len, tuple_t *tmp, uint32_t *mid) {
+    uint32_t width = sort_blocks(a, len);
+    uint32_t passes = 0;
+    tuple_t *src = a, *dst = tmp;
+
+    for (; (uint64_t)width * 2 < len; width <<= 1) {
+        for (uint32_t i = 0; i < len; i += (width << 1)) {
+            uint32_t m = i + width < len ? i + width : len;
+            uint32_t right = m + width < len ? m + width : len;
+            merge(src, i, m, right, dst);
+        }
+        tuple_t *t = src;
+        src = dst;
+        dst = t;
+        passes++;
+    }
+
+    count_bytes((uint64_t)len * (passes + 1));
+    *mid = width < len ? width : len;
+    return src;
+}
+
+void init_merge_stream(merge_stream_t *st, const tuple_t *x, uint32_t nx, const tuple_t *y, uint32_t ny) {
+    st->x = x;
+    st->y = y;
+    st->nx = nx;
+    st->ny = ny;
+    st->k = 0;
+    st->i = 0;
+    st->pos = 0;
+    st->num = 0;
+}
+
+static void refill_merge_stream(merge_stream_t *st) {
+    uint32_t i = st->i, j = st->k - st->i;
+    uint32_t num = st->nx + st->ny - st->k < STREAM_TUPLES ? st->nx + st->ny - st->k : STREAM_TUPLES;
+
+    // the next num outputs come from the next num tuples of either run at most,
+    // so the co-rank search stays inside a window that is already in cache
+    uint32_t wx = st->nx - i < num ? st->nx - i : num;
+    uint32_t wy = st->ny - j < num ? st->ny - j : num;
+    uint32_t from_x = merge_path(&st->x[i], wx, &st->y[j], wy, num);
+
+    merge_runs(&st->x[i], from_x, &st->y[j], num - from_x, st->buf);
+    __atomic_fetch_add(&sort_bytes, (uint64_t)num * sizeof(tuple_t), __ATOMIC_RELAXED);
+
+    st->num = num;
+    st->pos = 0;
+    st->k += num;
+    st->i += from_x;
+}
+
+// next tuple of the merged order without consuming it, NULL at the end
+static inline const tuple_t *merge_stream_peek(merge_stream_t *st) {
+    if (st->pos == st->num)
+        refill_merge_stream(st);
+    return st->pos < st->num ? &st->buf[st->pos] : NULL;
+}
+
+// merge_join() over two streams, an r key group is copied aside so it can be
+// paired with every s tuple of the same key
+uint64_t merge_join_streams(merge_stream_t *r, merge_stream_t *s, join_sink_t *sink) {
+    const tuple_t *a, *b;
+    tuple_t *group = NULL;
+    uint32_t group_cap = 0;
+    uint64_t matches = 0;
+
+    while ((a = merge_stream_peek(r)) != NULL && (b = merge_stream_peek(s)) != NULL) {
+        if (a->key < b->key) {
+            r->pos++;
+        }
+        else if (a->key > b->key) {
+            s->pos++;
+        }
+        else {
+            tuple_key_t key = a->key;
+            tuple_t first = *a;
+            r->pos++;
+
+            // a single r tuple needs no copy
+            a = merge_stream_peek(r);
+            if (a == NULL || a->key != key) {
+                while ((b = merge_stream_peek(s)) != NULL && b->key == key) {
+                    if (sink != NULL)
+                        join_sink_put(sink, first.value, b->value);
+                    matches++;
+                    s->pos++;
+                }
+                continue;
+            }
+
+            uint32_t group_num = 0;
+            for (; a != NULL && a->key == key; a = merge_stream_peek(r)) {
+                if (group_num + 2 > group_cap) {
+                    group_cap = group_cap ? group_cap * 2 : 16;
+                    group = realloc(group, group_cap * sizeof(tuple_t));
+                    assert(group != NULL);
+                }
+                if (group_num == 0)
+                    group[group_num++] = first;
+                group[group_num++] = *a;
+                r->pos++;
+            }
+
+            while ((b = merge_stream_peek(s)) != NULL && b->key == key) {
+                if (sink != NULL) {
+                    for (uint32_t x = 0; x < group_num; x++)
+                        join_sink_put(sink, group[x].value, b->value);
+                }
+                matches += group_num;
+                s->pos++;
+            }
+        }
+    }
+
+    if (sink != NULL)
+        flush_join_sink(sink);
+    free(group);
+
+    return matches;
+}
+
+// sort r and s and join them in one go, tmp_r and tmp_s hold num_r and num_s
+// tuples. r and s are not sorted afterwards, merge_sort() and merge_join() are
+// still there when the sorted arrays are needed
+uint64_t merge_sort_join(tuple_t *r, uint32_t num_r, tuple_t *s, uint32_t num_s,
+                         tuple_t *tmp_r, tuple_t *tmp_s, join_sink_t *sink) {
+    merge_stream_t *rs = malloc(sizeof(merge_stream_t));
+    merge_stream_t *ss = malloc(sizeof(merge_stream_t));
+    assert(rs != NULL && ss != NULL);
+
+    uint32_t mid_r, mid_s;
+    tuple_t *run_r = sort_to_two_runs(r, num_r, tmp_r, &mid_r);
+    tuple_t *run_s = sort_to_two_runs(s, num_s, tmp_s, &mid_s);
+
+    init_merge_stream(rs, run_r, mid_r, &run_r[mid_r], num_r - mid_r);
+    init_merge_stream(ss, run_s, mid_s, &run_s[mid_s], num_s - mid_s);
+    uint64_t matches = merge_join_streams(rs, ss, sink);
+
+    free(rs);
+    free(ss);
+    return matches;
+}
+
+/*
+ * sort-based group-by aggregation
+ *
+ * the last merge pass is a merge_stream_t like in merge_sort_join(), every key
+ * group is collapsed into one agg_t as the merged tuples come out, so neither
+ * the sorted array nor a second scan over it is needed. the parallel version
+ * aggregates one chunk per thread and combines the sorted partial results.
+ */
+
+typedef struct {
+    tuple_key_t   key;
+    uint32_t      count;
+    uint64_t      sum;
+    tuple_value_t min;
+    tuple_value_t max;
+} agg_t;
+
+static inline void agg_init(agg_t *g, const tuple_t *t) {
+    g->key = t->key;
+    g->count = 1;
+    g->sum = t->value;
+    g->min = t->value;
+    g->max = t->value;
+}
+
+static inline void agg_update(agg_t *g, const tuple_t *t) {
+    g->count++;
+    g->sum += t->value;
+    g->min = t->value < g->min ? t->value : g->min;
+    g->max = t->value > g->max ? t->value : g->max;
+}
+
+static inline void agg_combine(agg_t *g, const agg_t *p) {
+    g->count += p->count;
+    g->sum += p->sum;
+    g->min = p->min < g->min ? p->min : g->min;
+    g->max = p->max > g->max ? p->max : g->max;
+}
+
+// sort a and write one agg_t per key in key order to out, returns the groups.
+// a is left unsorted, out holds up to len groups
+uint32_t merge_sort_aggregate(tuple_t *a, uint32_t len, tuple_t *tmp, agg_t *out) {
+    merge_stream_t *st = malloc(sizeof(merge_stream_t));
+    assert(st != NULL);
+
+    uint32_t mid;
+    tuple_t *run = sort_to_two_runs(a, len, tmp, &mid);
+    init_merge_stream(st, run, mid, &run[mid], len - mid);
+
+    uint32_t n = 0;
+    while (merge_stream_peek(st) != NULL) {
+        for (; st->pos < st->num; st->pos++) {
+            const tuple_t *t = &st->buf[st->pos];
+            if (n > 0 && out[n - 1].key == t->key)
+                agg_update(&out[n - 1], t);
+            else
+                agg_init(&out[n++], t);
+        }
+    }
+
+    free(st);
+    return n;
+}
 
-void merge(tuple_t *a, uint32_t left, uint32_t mid, uint32_t right, tuple_t *tmp) {
-    uint32_t i = left;
-    uint32_t j = mid;
-    uint32_t k = left;
+// merge sorted partial results into out, groups of the same key are combined.
+// there is one part per thread, a linear scan for the smallest head is enough
+uint32_t combine_aggregates(agg_t **part, const uint32_t *part_len, uint32_t part_num, agg_t *out) {
+    uint32_t pos[part_num];
+    uint32_t n = 0;
+
+    memset(pos, 0, sizeof(pos));
+    for (;;) {
+        int best = -1;
+        for (uint32_t p = 0; p < part_num; p++) {
+            if (pos[p] < part_len[p] && (best < 0 || part[p][pos[p]].key < part[best][pos[best]].key))
+                best = p;
+        }
+        if (best < 0)
+            break;
 
-    while (i < mid && j < right) {
-        if (a[i].key < a[j].key)
-            tmp[k++] = a[i++];
+        const agg_t *g = &part[best][pos[best]++];
+        if (n > 0 && out[n - 1].key == g->key)
+            agg_combine(&out[n - 1], g);
         else
-            tmp[k++] = a[j++];
+            out[n++] = *g;
     }
 
-    while (i < mid)
-        tmp[k++] = a[i++];
+    return n;
+}
+
+typedef struct {
+    tuple_t *a;
+    tuple_t *tmp;
+    agg_t *out;
+    uint32_t len;
+    uint32_t num;
+    pthread_t thread;
+} par_agg_arg_t;
 
-    while (j < right)
-        tmp[k++] = a[j++];
+void *merge_sort_aggregate_worker(void *arg) {
+    par_agg_arg_t *par = arg;
+    par->num = merge_sort_aggregate(par->a, par->len, par->tmp, par->out);
+    return NULL;
 }
 
-#if 0 // change algo method
+// the partial results go to agg_tmp, out and agg_tmp hold up to len groups
+// each, returns the groups in out
+uint32_t merge_sort_aggregate_parallel(tuple_t *a, uint32_t len, tuple_t *tmp, agg_t *out,
+                                       agg_t *agg_tmp, uint32_t thread_num) {
+    if (thread_num <= 1 || len < thread_num * AVX512_BLOCK_TUPLES)
+        return merge_sort_aggregate(a, len, tmp, out);
 
-// recursive
-void __merge_sort(tuple_t *a, uint32_t left, uint32_t right, tuple_t *tmp) {
-    uint32_t mid;
-    if (left < right - 1) {
-        mid = (right + left) >> 1;
-        __merge_sort(a, left, mid, tmp);
-        __merge_sort(a, mid, right, tmp);
-        merge(a, left, mid, right, tmp);
-        memcpy(a + left, tmp + left, sizeof(tuple_t) * (right - left));
+    get_simd_level(); // detect before the threads race on it
+
+    par_agg_arg_t args[thread_num];
+    for (uint32_t i = 0; i < thread_num; i++) {
+        uint32_t k0 = slice_begin(len, i, thread_num);
+        args[i].a = &a[k0];
+        args[i].tmp = &tmp[k0];
+        args[i].out = &agg_tmp[k0];
+        args[i].len = slice_begin(len, i + 1, thread_num) - k0;
+        int ret = pthread_create(&args[i].thread, NULL, merge_sort_aggregate_worker, &args[i]);
+        assert(ret == 0);
+    }
+
+    for (uint32_t i = 0; i < thread_num; i++)
+        pthread_join(args[i].thread, NULL);
+
+    agg_t *part[thread_num];
+    uint32_t part_len[thread_num];
+    for (uint32_t i = 0; i < thread_num; i++) {
+        part[i] = args[i].out;
+        part_len[i] = args[i].num;
     }
+
+    return combine_aggregates(part, part_len, thread_num, out);
 }
 
-static inline void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
-    __merge_sort(a, 0, len, tmp);
+/*
+ * blocked bloom filter for a semi-join prefilter
+ *
+ * a key maps to one 32-byte block and sets one bit in each of its 8 words, the
+ * bit of word i picked by multiplying the hash with salt i. a lookup touches a
+ * single block, never two cache lines, and the 8 words are one avx2 register:
+ * one multiply, shift and test per key. filtering the larger relation by the
+ * keys of the smaller one drops most tuples without a partner before the sort.
+ */
+
+#define BLOOM_BITS_PER_KEY 16
+
+typedef struct {
+    uint32_t (*block)[8];
+    uint32_t block_bits;
+} bloom_filter_t;
+
+static const uint32_t bloom_salt[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+void init_bloom_filter(bloom_filter_t *bf, uint32_t key_num) {
+    bf->block_bits = 1; // one cache line at least, aligned_alloc() takes whole lines
+    while (((uint64_t)256 << bf->block_bits) < (uint64_t)key_num * BLOOM_BITS_PER_KEY)
+        bf->block_bits++;
+
+    size_t bytes = (size_t)32 << bf->block_bits;
+    bf->block = aligned_alloc(64, bytes);
+    assert(bf->block != NULL);
+    memset(bf->block, 0, bytes);
 }
 
-#else
+void destroy_bloom_filter(bloom_filter_t *bf) {
+    free(bf->block);
+    bf->block = NULL;
+}
 
-// non-recursive
-void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
+// high half picks the block, low half the bits
+static inline uint64_t bloom_hash(tuple_key_t key) {
+    return (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint32_t bloom_block(const bloom_filter_t *bf, uint64_t h) {
+    return bf->block_bits ? (uint32_t)(h >> (64 - bf->block_bits)) : 0;
+}
+
+void bloom_insert(bloom_filter_t *bf, tuple_key_t key) {
+    uint64_t h = bloom_hash(key);
+    uint32_t *w = bf->block[bloom_block(bf, h)];
+    for (int i = 0; i < 8; i++)
+        w[i] |= 1U << (((uint32_t)h * bloom_salt[i]) >> 27);
+}
+
+static inline bool bloom_contains(const bloom_filter_t *bf, tuple_key_t key) {
+    uint64_t h = bloom_hash(key);
+    const uint32_t *w = bf->block[bloom_block(bf, h)];
+    for (int i = 0; i < 8; i++) {
+        if ((w[i] & (1U << (((uint32_t)h * bloom_salt[i]) >> 27))) == 0)
+            return false;
+    }
+    return true;
+}
+
+// copy the tuples of src that may have a key in bf to dst, dst may be src
+uint32_t bloom_filter_tuples_scalar(const bloom_filter_t *bf, const tuple_t *src, uint32_t num, tuple_t *dst) {
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        tuple_t t = src[i];
+        dst[k] = t;
+        k += bloom_contains(bf, t.key);
+    }
+    return k;
+}
+
+#if defined(__x86_64__)
+
+uint32_t AVX2_TARGET bloom_filter_tuples_avx2(const bloom_filter_t *bf, const tuple_t *src, uint32_t num, tuple_t *dst) {
+    const __m256i salt = _mm256_loadu_si256((const __m256i *)bloom_salt);
+    const __m256i one = _mm256_set1_epi32(1);
+    uint32_t k = 0;
+
+    for (uint32_t i = 0; i < num; i++) {
+        tuple_t t = src[i];
+        uint64_t h = bloom_hash(t.key);
+        __m256i bits = _mm256_mullo_epi32(_mm256_set1_epi32((uint32_t)h), salt);
+        bits = _mm256_sllv_epi32(one, _mm256_srli_epi32(bits, 27));
+        __m256i w = _mm256_load_si256((const __m256i *)bf->block[bloom_block(bf, h)]);
+        dst[k] = t;
+        k += _mm256_testc_si256(w, bits); // all 8 bits set
+    }
+
+    return k;
+}
+
+#endif
+
+uint32_t bloom_filter_tuples(const bloom_filter_t *bf, const tuple_t *src, uint32_t num, tuple_t *dst) {
+#if defined(__x86_64__)
+    if (get_simd_level() >= SIMD_AVX2)
+        return bloom_filter_tuples_avx2(bf, src, num, dst);
+#endif
+    return bloom_filter_tuples_scalar(bf, src, num, dst);
+}
+
+// keep only the tuples of big whose key may be in small, returns how many
+uint32_t semi_join_prefilter(const tuple_t *small, uint32_t num_small, tuple_t *big, uint32_t num_big) {
+    bloom_filter_t bf;
+
+    init_bloom_filter(&bf, num_small);
+    for (uint32_t i = 0; i < num_small; i++)
+        bloom_insert(&bf, small[i].key);
+
+    uint32_t kept = bloom_filter_tuples(&bf, big, num_big, big);
+    destroy_bloom_filter(&bf);
+    return kept;
+}
+
+/*
+ * top-k and range extract
+ *
+ * instead of sorting everything, a filter streams over the input and keeps
+ * only tuples below a threshold in a candidate buffer. when the buffer fills,
+ * quickselect cuts it back to the k smallest and the threshold drops to the
+ * largest key kept, so later chunks pass ever fewer tuples. only the
+ * survivors are sorted. the filter is a branch-free simd compaction: one
+ * unsigned compare of key - lo against hi - lo per tuple, then compress store
+ * with avx-512 or a shuffle table with avx2.
+ */
+
+#define TOPK_MIN_CHUNK 1024
+
+// copy the tuples of src with lo <= key < lo + span to dst, returns how many
+uint32_t filter_range_scalar(const tuple_t *src, uint32_t num, tuple_key_t lo, uint32_t span, tuple_t *dst) {
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        tuple_t t = src[i];
+        dst[k] = t;
+        k += (uint32_t)(t.key - lo) < span;
+    }
+    return k;
+}
+
+#if defined(__x86_64__)
+
+// epi32 permutation for every 4-bit mask of selected tuples, selected first
+static const uint32_t compact_perm[16][8] = {
+    {0, 1, 0, 1, 0, 1, 0, 1},
+    {0, 1, 0, 1, 0, 1, 0, 1},
+    {2, 3, 0, 1, 0, 1, 0, 1},
+    {0, 1, 2, 3, 0, 1, 0, 1},
+    {4, 5, 0, 1, 0, 1, 0, 1},
+    {0, 1, 4, 5, 0, 1, 0, 1},
+    {2, 3, 4, 5, 0, 1, 0, 1},
+    {0, 1, 2, 3, 4, 5, 0, 1},
+    {6, 7, 0, 1, 0, 1, 0, 1},
+    {0, 1, 6, 7, 0, 1, 0, 1},
+    {2, 3, 6, 7, 0, 1, 0, 1},
+    {0, 1, 2, 3, 6, 7, 0, 1},
+    {4, 5, 6, 7, 0, 1, 0, 1},
+    {0, 1, 4, 5, 6, 7, 0, 1},
+    {2, 3, 4, 5, 6, 7, 0, 1},
+    {0, 1, 2, 3, 4, 5, 6, 7},
+};
+
+// stores whole registers, dst must have room up to the position of src
+uint32_t AVX2_TARGET filter_range_avx2(const tuple_t *src, uint32_t num, tuple_key_t lo, uint32_t span, tuple_t *dst) {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i vlo = _mm256_set1_epi32(lo);
+    const __m256i vspan = _mm256_xor_si256(_mm256_set1_epi32(span), sign);
+    uint32_t i = 0, k = 0;
+
+    for (; i + 4 <= num; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        __m256i d = _mm256_xor_si256(_mm256_sub_epi32(v, vlo), sign);
+        // move the key compare of each tuple to its sign bit
+        __m256i lt = _mm256_slli_epi64(_mm256_cmpgt_epi32(vspan, d), 32);
+        uint32_t m = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+        __m256i perm = _mm256_loadu_si256((const __m256i *)compact_perm[m]);
+        _mm256_storeu_si256((__m256i *)&dst[k], _mm256_permutevar8x32_epi32(v, perm));
+        k += __builtin_popcount(m);
+    }
+
+    return k + filter_range_scalar(&src[i], num - i, lo, span, &dst[k]);
+}
+
+uint32_t AVX512_TARGET filter_range_avx512(const tuple_t *src, uint32_t num, tuple_key_t lo, uint32_t span, tuple_t *dst) {
+    const __m512i low = _mm512_set1_epi64(0xffffffff);
+    const __m512i vlo = _mm512_set1_epi64(lo);
+    const __m512i vspan = _mm512_set1_epi64(span);
+    uint32_t i = 0, k = 0;
+
+    for (; i + 8 <= num; i += 8) {
+        __m512i v = _mm512_loadu_si512(&src[i]);
+        __m512i d = _mm512_and_si512(_mm512_sub_epi64(_mm512_and_si512(v, low), vlo), low);
+        __mmask8 m = _mm512_cmplt_epu64_mask(d, vspan);
+        _mm512_mask_compressstoreu_epi64(&dst[k], m, v);
+        k += __builtin_popcount(m);
+    }
+
+    return k + filter_range_scalar(&src[i], num - i, lo, span, &dst[k]);
+}
+
+#endif
+
+// dst may be src, it is written no further than src has been read
+uint32_t filter_range(const tuple_t *src, uint32_t num, tuple_key_t lo, uint32_t span, tuple_t *dst) {
+    switch (get_simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX512:
+        return filter_range_avx512(src, num, lo, span, dst);
+    case SIMD_AVX2:
+        return filter_range_avx2(src, num, lo, span, dst);
+#endif
+    default:
+        return filter_range_scalar(src, num, lo, span, dst);
+    }
+}
+
+// reorder a so a[0, k) holds the k smallest keys, 0 < k <= num
+void select_tuples(tuple_t *a, uint32_t num, uint32_t k) {
+    int64_t left = 0, right = (int64_t)num - 1, nth = (int64_t)k - 1;
+
+    while (left < right) {
+        // median of three as the pivot
+        int64_t mid = left + ((right - left) >> 1);
+        tuple_key_t x = a[left].key, y = a[mid].key, z = a[right].key;
+        tuple_key_t pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+        int64_t i = left, j = right;
+        while (i <= j) {
+            while (a[i].key < pivot)
+                i++;
+            while (a[j].key > pivot)
+                j--;
+            if (i <= j) {
+                tuple_t t = a[i];
+                a[i] = a[j];
+                a[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        // [left, j] <= pivot <= [i, right], anything between equals pivot
+        if (nth <= j)
+            right = j;
+        else if (nth >= i)
+            left = i;
+        else
+            break;
+    }
+}
+
+// the k smallest tuples of a sorted into out, returns min(k, len). a is not
+// modified, out and tmp hold k tuples
+uint32_t top_k(const tuple_t *a, uint32_t len, uint32_t k, tuple_t *out, tuple_t *tmp) {
+    if (k > len)
+        k = len;
+    if (k == 0)
+        return 0;
+
+    uint32_t cap = k * 2 > k + TOPK_MIN_CHUNK ? k * 2 : k + TOPK_MIN_CHUNK;
+    tuple_t *cand = malloc(cap * sizeof(tuple_t));
+    assert(cand != NULL);
+
+    // the first cap tuples pass unfiltered
+    uint32_t i = len < cap ? len : cap;
+    uint32_t n = i;
+    memcpy(cand, a, i * sizeof(tuple_t));
+
+    while (i < len) {
+        select_tuples(cand, n, k);
+        n = k;
+
+        tuple_key_t threshold = cand[0].key;
+        for (uint32_t j = 1; j < k; j++)
+            threshold = cand[j].key > threshold ? cand[j].key : threshold;
+
+        // ties with the threshold cannot improve the result
+        while (i < len && n < cap) {
+            uint32_t chunk = len - i < cap - n ? len - i : cap - n;
+            n += filter_range(&a[i], chunk, 0, threshold, &cand[n]);
+            i += chunk;
+        }
+    }
+
+    select_tuples(cand, n, k);
+    memcpy(out, cand, k * sizeof(tuple_t));
+    merge_sort(out, k, tmp);
+
+    free(cand);
+    return k;
+}
+
+// the tuples with lo <= key < hi sorted into out, returns how many. out and
+// tmp hold len tuples
+uint32_t extract_range(const tuple_t *a, uint32_t len, tuple_key_t lo, tuple_key_t hi, tuple_t *out, tuple_t *tmp) {
+    if (hi <= lo)
+        return 0;
+
+    uint32_t n = filter_range(a, len, lo, hi - lo, out);
+    merge_sort(out, n, tmp);
+    return n;
+}
+
+/*
+ * columnar mode: keys and values in separate arrays
+ *
+ * only key << 32 | row id is sorted, so a pass moves 8 bytes per row however
+ * wide the payload is, and the packed lanes run through the same simd kernels
+ * without the key/value swap. the payloads are permuted once at the end by
+ * gather_values(), or never when the join only needs the matching row ids.
+ */
+
+static inline uint64_t pack_key(tuple_key_t key, uint32_t row) {
+    return (uint64_t)key << 32 | row;
+}
+
+static inline tuple_key_t packed_key(uint64_t p) {
+    return (tuple_key_t)(p >> 32);
+}
+
+static inline uint32_t packed_row(uint64_t p) {
+    return (uint32_t)p;
+}
+
+void pack_keys(const tuple_key_t *keys, uint32_t num, uint64_t *packed) {
+    for (uint32_t i = 0; i < num; i++)
+        packed[i] = pack_key(keys[i], i);
+}
+
+// bottom-up like merge_sort(), equal keys stay in row order
+void merge_sort_u64(uint64_t *a, uint32_t len, uint64_t *tmp) {
     if (len <= 1)
         return;
 
     uint32_t toggle = 0;
-    tuple_t *src, *dst;
-    for (uint32_t width = 1; width < len; width <<= 1) {
+    uint64_t *src, *dst;
+    for (uint32_t width = sort_blocks_u64(a, len); width < len; width <<= 1) {
         if (toggle & 1) {
             src = tmp;
             dst = a;
@@ -72,7 +2248,6 @@ void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
             src = a;
             dst = tmp;
         }
-        //clock_t t = clock();
         for (uint32_t i = 0; i < len; i += (width << 1)) {
             uint32_t mid = i + width;
             if (mid > len)
@@ -82,30 +2257,77 @@ void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
             if (right > len)
                 right = len;
 
-            merge(src, i, mid, right, dst);
+            merge_runs_u64(&src[i], mid - i, &src[mid], right - mid, &dst[i]);
         }
-        //t = clock() - t;
-        //printf("width: %d, time: %f ms\n", width, (float)t * 1000 / CLOCKS_PER_SEC);
         toggle++;
     }
 
-    if (toggle & 1)
-        memcpy(a, tmp, len * sizeof(tuple_t));
+    if (toggle & 1) {
+        memcpy(a, tmp, len * sizeof(uint64_t));
+        toggle++;
+    }
+
+    __atomic_fetch_add(&sort_bytes, (uint64_t)len * (toggle + 1) * 2 * sizeof(uint64_t), __ATOMIC_RELAXED);
 }
 
-#endif
+// out[i] = values[row of packed[i]], the common widths copy a fixed-size type
+void gather_values(const uint64_t *packed, uint32_t num, const void *values, uint32_t value_size, void *out) {
+    switch (value_size) {
+    case 4:
+        for (uint32_t i = 0; i < num; i++)
+            ((uint32_t *)out)[i] = ((const uint32_t *)values)[packed_row(packed[i])];
+        break;
+    case 8:
+        for (uint32_t i = 0; i < num; i++)
+            ((uint64_t *)out)[i] = ((const uint64_t *)values)[packed_row(packed[i])];
+        break;
+    case 16:
+        for (uint32_t i = 0; i < num; i++) {
+            uint32_t row = packed_row(packed[i]);
+            ((uint64_t *)out)[i * 2] = ((const uint64_t *)values)[row * 2];
+            ((uint64_t *)out)[i * 2 + 1] = ((const uint64_t *)values)[row * 2 + 1];
+        }
+        break;
+    default:
+        for (uint32_t i = 0; i < num; i++)
+            memcpy((uint8_t *)out + (size_t)i * value_size,
+                   (const uint8_t *)values + (size_t)packed_row(packed[i]) * value_size, value_size);
+        break;
+    }
+}
 
-uint32_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, void *output) {
-    uint32_t i = 0, j = 0, matches = 0;
+// merge_join() over sorted packed keys, equal key groups give their full cross
+// product. the row ids of the first match_cap matches go to match_r and match_s
+// when they are not NULL, the count covers every match
+uint64_t merge_join_keys(const uint64_t *r, const uint64_t *s, uint32_t num_r, uint32_t num_s,
+                         uint32_t *match_r, uint32_t *match_s, uint64_t match_cap) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
 
     while (i < num_r && j < num_s) {
-        if (r[i].key < s[j].key)
+        if (packed_key(r[i]) < packed_key(s[j]))
             i++;
-        else if (r[i].key > s[j].key)
+        else if (packed_key(r[i]) > packed_key(s[j]))
             j++;
         else {
-            matches++;
-            j++;
+            uint32_t ie = i + 1, je = j + 1;
+            while (ie < num_r && packed_key(r[ie]) == packed_key(r[i]))
+                ie++;
+            while (je < num_s && packed_key(s[je]) == packed_key(s[j]))
+                je++;
+
+            uint64_t m = matches;
+            for (uint32_t x = i; x < ie && m < match_cap; x++) {
+                for (uint32_t y = j; y < je && m < match_cap; y++, m++) {
+                    if (match_r != NULL)
+                        match_r[m] = packed_row(r[x]);
+                    if (match_s != NULL)
+                        match_s[m] = packed_row(s[y]);
+                }
+            }
+            matches += (uint64_t)(ie - i) * (je - j);
+            i = ie;
+            j = je;
         }
     }
 
@@ -117,7 +2339,7 @@ uint32_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, void
 void init_tuples(tuple_t *a, uint32_t size) {
     for (uint32_t i = 0; i < size; i++) {
         a[i].key = i;
-        //a[i].value = i + 1;
+        a[i].value = i + 1;
     }
 }
 
@@ -194,47 +2416,575 @@ void print_tuples(tuple_t *a, uint32_t size) {
 
 #endif
 
+bool is_tuples_ordered(tuple_t *a, uint32_t size) {
+    for (uint32_t i = 1; i < size; i++) {
+        if (a[i - 1].key > a[i].key)
+            return false;
+    }
+
+    return true;
+}
+
+// compare the merge kernels of every simd level the cpu supports
+void bench_merge_kernels(uint32_t size) {
+    const char *dataset_name[] = {"shuffled", "presorted", "duplicates"};
+    const char *level_name[] = {"scalar", "avx2", "avx512"};
+    int detected = detect_simd_level();
+
+    tuple_t *src = malloc(size * sizeof(tuple_t));
+    tuple_t *a = malloc(size * sizeof(tuple_t));
+    tuple_t *tmp = malloc(size * sizeof(tuple_t));
+    assert(src != NULL && a != NULL && tmp != NULL);
+
+    for (uint32_t d = 0; d < 3; d++) {
+        if (d == 0) {
+            init_tuples(src, size);
+            shuffle_tuples(src, size);
+        }
+        else if (d == 1) {
+            init_tuples(src, size);
+        }
+        else {
+            for (uint32_t i = 0; i < size; i++)
+                src[i].key = rand() % 16;
+        }
+
+        for (int level = SIMD_NONE; level <= detected; level++) {
+            memcpy(a, src, size * sizeof(tuple_t));
+            simd_level = level;
+
+            clock_t t = clock();
+            merge_sort(a, size, tmp);
+            t = clock() - t;
+
+            printf("%-10s %-6s time: %f ms\n", dataset_name[d], level_name[level], (float)t * 1000 / CLOCKS_PER_SEC);
+            assert(is_tuples_ordered(a, size));
+        }
+    }
+
+    simd_level = detected;
+    free(src);
+    free(a);
+    free(tmp);
+}
+
+static inline unsigned long long my_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_nsec + (unsigned long long)t.tv_sec * 1000000000ULL;
+}
+
+/*
+ * scalar sort and join specialized for wider layouts, see tuple_template.h
+ */
+
+#define TUPLE_SUFFIX  44
+#define TUPLE_KEY_T   uint32_t
+#define TUPLE_VALUE_T uint32_t
+#include "tuple_template.h"
+
+#define TUPLE_SUFFIX  88
+#define TUPLE_KEY_T   uint64_t
+#define TUPLE_VALUE_T uint64_t
+#include "tuple_template.h"
+
+#define TUPLE_SUFFIX  816
+#define TUPLE_KEY_T   uint64_t
+#define TUPLE_VALUE_T tuple_payload16_t
+#include "tuple_template.h"
+
+#define BENCH_LAYOUT(s, size) do {                                                      \
+        tuple_##s##_t *r = malloc((size) * sizeof(tuple_##s##_t));                     \
+        tuple_##s##_t *q = malloc((size) * sizeof(tuple_##s##_t));                     \
+        tuple_##s##_t *tmp = malloc((size) * sizeof(tuple_##s##_t));                   \
+        assert(r != NULL && q != NULL && tmp != NULL);                                  \
+        generate_tuples_##s(r, size);                                                   \
+        generate_tuples_##s(q, size);                                                   \
+        unsigned long long t = my_clock();                                              \
+        merge_sort_##s(r, size, tmp);                                                   \
+        merge_sort_##s(q, size, tmp);                                                   \
+        uint64_t matches = merge_join_##s(r, q, size, size, NULL);                      \
+        t = my_clock() - t;                                                             \
+        printf("layout: %s, tuple size: %zu, time: %f ms, matches: %lu\n", #s,         \
+               sizeof(tuple_##s##_t), (float)t / 1000000, (unsigned long)matches);      \
+        assert(is_tuples_sorted_##s(r, size) && is_tuples_sorted_##s(q, size));         \
+        free(r);                                                                        \
+        free(q);                                                                        \
+        free(tmp);                                                                      \
+    } while (0)
+
+#define ALGO_MERGE    0
+#define ALGO_RADIX    1
+#define ALGO_NATURAL  2
+#define ALGO_KWAY     3
+#define ALGO_TWOPHASE 4
+#define ALGO_NUM      5
+
+const char *algo_name[ALGO_NUM] = {"merge", "radix", "natural", "kway", "twophase"};
+
+typedef struct {
+    uint32_t algo;
+    uint32_t thread_num;
+    uint32_t digit_bits;
+    uint32_t fanin;
+} sort_opts_t;
+
+void sort_tuples(tuple_t *a, uint32_t len, tuple_t *tmp, const sort_opts_t *opts) {
+    switch (opts->algo) {
+    case ALGO_RADIX:
+        radix_sort(a, len, tmp, opts->digit_bits);
+        break;
+    case ALGO_NATURAL:
+        merge_sort_natural(a, len, tmp);
+        break;
+    case ALGO_KWAY:
+        merge_sort_kway(a, len, tmp, opts->fanin);
+        break;
+    case ALGO_TWOPHASE:
+        merge_sort_twophase(a, len, tmp);
+        break;
+    default:
+        merge_sort_parallel(a, len, tmp, opts->thread_num);
+        break;
+    }
+}
+
+int parse_algo(const char *name) {
+    for (int i = 0; i < ALGO_NUM; i++) {
+        if (strcmp(name, algo_name[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+
+// run the sort and join of one specialized layout, false if there is none
+bool bench_layout(const char *layout, uint32_t size) {
+    if (strcmp(layout, "44") == 0)
+        BENCH_LAYOUT(44, size);
+    else if (strcmp(layout, "88") == 0)
+        BENCH_LAYOUT(88, size);
+    else if (strcmp(layout, "816") == 0)
+        BENCH_LAYOUT(816, size);
+    else
+        return false;
+
+    return true;
+}
+
+// sort and join a columnar table through packed keys, then gather the payloads
+void bench_columnar(uint32_t size, uint32_t value_size) {
+    tuple_key_t *keys = malloc(size * sizeof(tuple_key_t) * 2);
+    uint8_t *values = malloc((size_t)size * value_size * 2);
+    uint8_t *gathered = malloc((size_t)size * value_size);
+    uint64_t *packed = malloc(size * sizeof(uint64_t) * 2);
+    uint64_t *tmp = malloc(size * sizeof(uint64_t));
+    uint32_t *match_r = malloc(size * sizeof(uint32_t));
+    uint32_t *match_s = malloc(size * sizeof(uint32_t));
+    assert(keys != NULL && values != NULL && gathered != NULL && packed != NULL);
+    assert(tmp != NULL && match_r != NULL && match_s != NULL);
+
+    // two relations back to back, every payload starts with its own row id
+    memset(values, 0, (size_t)size * value_size * 2);
+    for (uint32_t rel = 0; rel < 2; rel++) {
+        tuple_key_t *k = &keys[rel * size];
+        for (uint32_t i = 0; i < size; i++) {
+            k[i] = i;
+            memcpy(&values[((size_t)rel * size + i) * value_size], &i, sizeof(i));
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            uint32_t j = rand() % size;
+            tuple_key_t t = k[i];
+            k[i] = k[j];
+            k[j] = t;
+        }
+    }
+
+    printf("begin columnar sort and merge join, value size: %u\n", value_size);
+
+    sort_bytes = 0;
+    unsigned long long t = my_clock();
+    for (uint32_t rel = 0; rel < 2; rel++) {
+        pack_keys(&keys[rel * size], size, &packed[rel * size]);
+        merge_sort_u64(&packed[rel * size], size, tmp);
+    }
+    unsigned long long t_sort = my_clock() - t;
+
+    t = my_clock();
+    uint64_t matches = merge_join_keys(packed, &packed[size], size, size, match_r, match_s, size);
+    unsigned long long t_join = my_clock() - t;
+
+    t = my_clock();
+    gather_values(packed, size, values, value_size, gathered);
+    unsigned long long t_gather = my_clock() - t;
+
+    printf("sort: %f ms, join: %f ms, gather: %f ms, matches: %lu\n", (float)t_sort / 1000000,
+           (float)t_join / 1000000, (float)t_gather / 1000000, (unsigned long)matches);
+
+    // the same passes over whole rows would move (key + value) / 8 times as much
+    uint64_t row_bytes = sort_bytes / sizeof(uint64_t) * (sizeof(tuple_key_t) + value_size);
+    uint64_t gather_bytes = (uint64_t)size * (sizeof(uint64_t) + 2 * value_size);
+    printf("bytes moved: %f MB keys + %f MB gather, as rows: %f MB\n", (double)sort_bytes / 1024 / 1024,
+           (double)gather_bytes / 1024 / 1024, (double)row_bytes / 1024 / 1024);
+
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t row;
+        memcpy(&row, &gathered[(size_t)i * value_size], sizeof(row));
+        assert(row == packed_row(packed[i]));
+        assert(i == 0 || packed[i - 1] < packed[i]);
+        assert(keys[row] == packed_key(packed[i]));
+    }
+    for (uint32_t i = 0; i < matches && i < size; i++)
+        assert(keys[match_r[i]] == keys[size + match_s[i]]);
+
+    free(keys);
+    free(values);
+    free(gathered);
+    free(packed);
+    free(tmp);
+    free(match_r);
+    free(match_s);
+}
+
+typedef struct {
+    uint64_t pairs;
+    uint64_t batches;
+    uint64_t checksum;
+} join_consumer_t;
+
+// stand-in for a downstream operator, folds every batch into a checksum
+void consume_pairs(const join_pair_t *pairs, uint32_t num, void *ctx) {
+    join_consumer_t *c = ctx;
+    for (uint32_t i = 0; i < num; i++)
+        c->checksum += (uint64_t)pairs[i].r * 31 + pairs[i].s;
+    c->pairs += num;
+    c->batches++;
+}
+
+// group-by over size tuples with keys in [0, groups), checked against a direct count
+void bench_aggregate(uint32_t size, uint32_t groups, uint32_t thread_num) {
+    tuple_t *a = malloc(size * sizeof(tuple_t));
+    tuple_t *tmp = malloc(size * sizeof(tuple_t));
+    agg_t *out = malloc(size * sizeof(agg_t));
+    agg_t *agg_tmp = malloc(size * sizeof(agg_t));
+    uint32_t *count = calloc(groups, sizeof(uint32_t));
+    assert(a != NULL && tmp != NULL && out != NULL && agg_tmp != NULL && count != NULL);
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        a[i].key = rand() % groups;
+        a[i].value = rand() % 1000;
+        count[a[i].key]++;
+        sum += a[i].value;
+    }
+    memset(tmp, 0, size * sizeof(tuple_t));
+
+    printf("begin sort and group-by, groups: %u\n", groups);
+
+    sort_bytes = 0;
+    unsigned long long t = my_clock();
+    uint32_t n = merge_sort_aggregate_parallel(a, size, tmp, out, agg_tmp, thread_num);
+    t = my_clock() - t;
+
+    printf("threads: %u, time: %f ms, groups: %u, bytes moved: %f MB\n", thread_num, (float)t / 1000000, n,
+           (double)sort_bytes / 1024 / 1024);
+
+    uint64_t agg_sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        assert(i == 0 || out[i - 1].key < out[i].key);
+        assert(out[i].count == count[out[i].key] && out[i].min <= out[i].max);
+        agg_sum += out[i].sum;
+    }
+    assert(agg_sum == sum);
+
+    free(a);
+    free(tmp);
+    free(out);
+    free(agg_tmp);
+    free(count);
+}
+
+// top-k and range extract against a full sort, the keys are 0 .. size - 1
+void bench_topk(uint32_t size, uint32_t k, tuple_key_t lo, tuple_key_t hi) {
+    tuple_t *a = malloc(size * sizeof(tuple_t));
+    tuple_t *out = malloc(size * sizeof(tuple_t));
+    tuple_t *tmp = malloc(size * sizeof(tuple_t));
+    assert(a != NULL && out != NULL && tmp != NULL);
+
+    generate_dataset(a, size);
+    memset(out, 0, size * sizeof(tuple_t));
+    memset(tmp, 0, size * sizeof(tuple_t));
+
+    if (k > 0) {
+        unsigned long long t = my_clock();
+        uint32_t n = top_k(a, size, k, out, tmp);
+        t = my_clock() - t;
+        printf("top-k: %u, time: %f ms\n", n, (float)t / 1000000);
+        for (uint32_t i = 0; i < n; i++)
+            assert(out[i].key == i);
+    }
+
+    if (hi > lo) {
+        unsigned long long t = my_clock();
+        uint32_t n = extract_range(a, size, lo, hi, out, tmp);
+        t = my_clock() - t;
+        printf("range: [%u, %u), tuples: %u, time: %f ms\n", lo, hi, n, (float)t / 1000000);
+        assert(n == (hi < size ? hi : size) - (lo < size ? lo : size));
+        for (uint32_t i = 0; i < n; i++)
+            assert(out[i].key == lo + i);
+    }
+
+    memcpy(out, a, size * sizeof(tuple_t));
+    unsigned long long t = my_clock();
+    merge_sort(out, size, tmp);
+    t = my_clock() - t;
+    printf("full sort, time: %f ms\n", (float)t / 1000000);
+
+    free(a);
+    free(out);
+    free(tmp);
+}
+
+void usage(const char *exec_name) {
+    printf("usage: %s [-b] [-l layout] [-c value_size] [-r r_size] [-p] [-f] [-g groups] [-K k] [-x lo:hi] [-a algo] [-t thread_num] [-d digit_bits] [-k fanin] tuples_size\n"
+           "\t-b \tbenchmark the scalar and simd merge kernels\n"
+           "\t-l \tsort and join the specialized key+value layout: 44, 88, 816\n"
+           "\t-c \tsort packed key and row ids of a columnar table, value_size bytes per row\n"
+           "\t-r \ttuples in the first relation (default: tuples_size)\n"
+           "\t-p \tfuse the last merge pass of both relations into the join (merge algo)\n"
+           "\t-f \tbloom filter the larger relation by the keys of the smaller before sorting\n"
+           "\t-g \tcount, sum, min and max of the values of groups random keys instead of a join\n"
+           "\t-K \tsort only the k smallest tuples\n"
+           "\t-x \tsort only the tuples with lo <= key < hi\n"
+           "\t-a \tsort algorithm: merge, radix, natural, kway, twophase (default: merge)\n"
+           "\t-t \tnumber of sort and join threads (default: 1)\n"
+           "\t-d \tradix digit bits: 8, 11 (default: 8)\n"
+           "\t-k \tfanin of the kway merge (default: 16)\n",
+           exec_name);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("usage: %s tuples_size", argv[0]);
+    bool bench = false;
+    const char *layout = NULL;
+    uint32_t value_size = 0;
+    int r_size = 0;
+    bool pipeline = false;
+    bool prefilter = false;
+    uint32_t groups = 0;
+    uint32_t top = 0;
+    tuple_key_t range_lo = 0, range_hi = 0;
+    sort_opts_t opts = {.algo = ALGO_MERGE, .thread_num = 1, .digit_bits = 8, .fanin = 16};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "bl:c:r:pfg:K:x:a:t:d:k:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            bench = true;
+            break;
+        case 'l':
+            layout = optarg;
+            break;
+        case 'c':
+            value_size = (uint32_t)atoi(optarg);
+            assert(value_size >= sizeof(uint32_t));
+            break;
+        case 'r':
+            r_size = atoi(optarg);
+            assert(r_size > 0);
+            break;
+        case 'p':
+            pipeline = true;
+            break;
+        case 'f':
+            prefilter = true;
+            break;
+        case 'g':
+            groups = (uint32_t)atoi(optarg);
+            assert(groups > 0);
+            break;
+        case 'K':
+            top = (uint32_t)atoi(optarg);
+            assert(top > 0);
+            break;
+        case 'x':
+            if (sscanf(optarg, "%u:%u", &range_lo, &range_hi) != 2 || range_hi <= range_lo) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'a':
+            if (parse_algo(optarg) < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            opts.algo = parse_algo(optarg);
+            break;
+        case 't':
+            opts.thread_num = (uint32_t)atoi(optarg);
+            assert(opts.thread_num > 0);
+            break;
+        case 'd':
+            opts.digit_bits = (uint32_t)atoi(optarg);
+            assert(opts.digit_bits == 8 || opts.digit_bits == 11);
+            break;
+        case 'k':
+            opts.fanin = (uint32_t)atoi(optarg);
+            assert(opts.fanin >= 2);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return -1;
     }
 
-    int size = atoi(argv[1]);
+    int size = atoi(argv[optind]);
     assert(size > 0);
+    if (r_size == 0)
+        r_size = size;
+
+    if (bench) {
+        bench_merge_kernels(size);
+        return 0;
+    }
+
+    if (layout != NULL) {
+        srand(time(NULL));
+        if (!bench_layout(layout, size)) {
+            usage(argv[0]);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (value_size != 0) {
+        srand(time(NULL));
+        bench_columnar(size, value_size);
+        return 0;
+    }
+
+    if (groups != 0) {
+        srand(time(NULL));
+        bench_aggregate(size, groups, opts.thread_num);
+        return 0;
+    }
+
+    if (top != 0 || range_hi != 0) {
+        srand(time(NULL));
+        bench_topk(size, top, range_lo, range_hi);
+        return 0;
+    }
 
     srand(time(NULL));
 
-    tuple_t *a = malloc(size * sizeof(tuple_t));
+    if (opts.algo == ALGO_TWOPHASE) {
+        detect_cache_sizes(&cache_sizes);
+        printf("l1: %lu KB, l2: %lu KB, llc: %lu KB\n", (unsigned long)(cache_sizes.l1 >> 10),
+               (unsigned long)(cache_sizes.l2 >> 10), (unsigned long)(cache_sizes.llc >> 10));
+    }
+
+    tuple_t *a = malloc(r_size * sizeof(tuple_t));
     assert(a != NULL);
 
     tuple_t *b = malloc(size * sizeof(tuple_t));
     assert(b != NULL);
 
-    printf("tuples size: %d, tuples memory: %f MB\n", size, (float)size * sizeof(tuple_t) / 1024 / 1024);
+    printf("tuples size: %d / %d, tuples memory: %f MB\n", r_size, size,
+           (float)(r_size + size) * sizeof(tuple_t) / 1024 / 1024);
 
-    generate_dataset(a, size);
+    generate_dataset(a, r_size);
     generate_dataset(b, size);
-    print_tuples(a, size);
+    print_tuples(a, r_size);
 
-    tuple_t *tmp = malloc(size * sizeof(tuple_t));
+    // the pipeline keeps both relations half merged, each needs its own tmp
+    uint32_t tmp_size = pipeline ? r_size + size : (r_size > size ? r_size : size);
+    tuple_t *tmp = malloc(tmp_size * sizeof(tuple_t));
     assert(tmp != NULL);
-    memset(tmp, 0, size * sizeof(tuple_t));
+    memset(tmp, 0, tmp_size * sizeof(tuple_t));
+
+    if (prefilter) {
+        unsigned long long t = my_clock();
+        uint32_t num = r_size <= size ? size : r_size;
+        uint32_t kept = r_size <= size ? (uint32_t)(size = semi_join_prefilter(a, r_size, b, size))
+                                       : (uint32_t)(r_size = semi_join_prefilter(b, size, a, r_size));
+        t = my_clock() - t;
+        printf("prefilter: kept %u of %u tuples, selectivity: %.2f%%, time: %f ms\n", kept, num,
+               100.0 * kept / num, (float)t / 1000000);
+    }
 
-    printf("begin merge sort and merge join\n");
+    if (pipeline) {
+        assert(opts.algo == ALGO_MERGE);
+        printf("begin pipelined merge sort and merge join\n");
 
-    clock_t t = clock();
-    merge_sort(a, size, tmp);
-    merge_sort(b, size, tmp);
+        join_pair_t *pairs = malloc(JOIN_BATCH_PAIRS * sizeof(join_pair_t));
+        assert(pairs != NULL);
+        join_consumer_t consumer = {0};
+        join_sink_t sink;
+        init_join_sink(&sink, pairs, JOIN_BATCH_PAIRS, consume_pairs, &consumer);
 
-    uint32_t matches = merge_join(a, b, size, size, tmp);
+        sort_bytes = 0;
+        unsigned long long t = my_clock();
+        uint64_t matches = merge_sort_join(a, r_size, b, size, tmp, &tmp[r_size], &sink);
+        t = my_clock() - t;
 
-    t = clock() - t;
-    printf("time: %f ms, matches: %u\n", (float)t * 1000 / CLOCKS_PER_SEC, matches);
+        printf("algo: pipeline, time: %f ms, matches: %lu\n", (float)t / 1000000, (unsigned long)matches);
+        printf("pairs: %lu in %lu batches, checksum: %lx\n", (unsigned long)consumer.pairs,
+               (unsigned long)consumer.batches, (unsigned long)consumer.checksum);
+        printf("bytes moved: %f MB, passes per relation: %.2f\n", (double)sort_bytes / 1024 / 1024,
+               (double)sort_bytes / (2.0 * (r_size + size) * sizeof(tuple_t)));
+        assert(consumer.pairs == matches);
+        return 0;
+    }
+
+    printf("begin %s sort and merge join\n", algo_name[opts.algo]);
+
+    sort_bytes = 0;
+    unsigned long long t = my_clock();
+    sort_tuples(a, r_size, tmp, &opts);
+    sort_tuples(b, size, tmp, &opts);
+    unsigned long long t_join = my_clock();
+
+    // one batch buffer and consumer per join thread, combined afterwards
+    uint32_t join_num = opts.thread_num;
+    join_pair_t *pairs = malloc(join_num * JOIN_BATCH_PAIRS * sizeof(join_pair_t));
+    assert(pairs != NULL);
+    join_consumer_t consumers[join_num];
+    join_sink_t sinks[join_num];
+    memset(consumers, 0, sizeof(consumers));
+    for (uint32_t i = 0; i < join_num; i++)
+        init_join_sink(&sinks[i], &pairs[i * JOIN_BATCH_PAIRS], JOIN_BATCH_PAIRS, consume_pairs, &consumers[i]);
+
+    int strategy;
+    uint64_t matches = merge_join_parallel(a, b, r_size, size, join_num, sinks, &strategy);
+
+    t_join = my_clock() - t_join;
+    t = my_clock() - t;
+
+    join_consumer_t consumer = {0};
+    for (uint32_t i = 0; i < join_num; i++) {
+        consumer.pairs += consumers[i].pairs;
+        consumer.batches += consumers[i].batches;
+        consumer.checksum += consumers[i].checksum;
+    }
+    printf("algo: %s, threads: %u, time: %f ms, matches: %lu\n", algo_name[opts.algo], opts.thread_num,
+           (float)t / 1000000, (unsigned long)matches);
+    printf("pairs: %lu in %lu batches, checksum: %lx\n", (unsigned long)consumer.pairs,
+           (unsigned long)consumer.batches, (unsigned long)consumer.checksum);
+    printf("join: %s, time: %f ms\n", join_name[strategy], (float)t_join / 1000000);
+    assert(consumer.pairs == matches);
+    printf("bytes moved: %f MB, passes per relation: %.2f\n", (double)sort_bytes / 1024 / 1024,
+           (double)sort_bytes / (2.0 * (r_size + size) * sizeof(tuple_t)));
 
-    print_tuples(a, size);
-    assert(is_tuples_sorted(a, size));
-    assert(is_tuples_sorted(b, size));
+    print_tuples(a, r_size);
+    // a filtered relation is no longer a dense range of keys
+    bool (*check_sorted)(tuple_t *, uint32_t) = prefilter ? is_tuples_ordered : is_tuples_sorted;
+    assert(check_sorted(a, r_size));
+    assert(check_sorted(b, size));
 
     return 0;
 
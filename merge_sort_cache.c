@@ -8,6 +8,7 @@
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 typedef uint32_t tuple_key_t;
 typedef uint32_t tuple_value_t;
@@ -38,6 +39,7 @@ typedef struct {
 } cache_mgr_t;
 
 cache_mgr_t cache[3];
+bool per_member = false;  // -g: the old get_member() per tuple path, for comparison
 
 void print_tuples(tuple_t *a, uint32_t size);
 
@@ -130,7 +132,15 @@ void *get_member(cache_mgr_t *mgr, uint32_t pos) {
     return &mgr->cache.buffer[(pos & mgr->pos_mask) << mgr->pos_shift];
 }
 
-void merge(cache_mgr_t *a, cache_mgr_t *b, uint32_t left, uint32_t mid, uint32_t right, cache_mgr_t *tmp) {
+// the tuples from pos to the end of its block, *num of them. the block is
+// switched in by get_member(), the pointer stays valid until the next call on mgr
+tuple_t *get_span(cache_mgr_t *mgr, uint32_t pos, uint32_t *num) {
+    tuple_t *t = get_member(mgr, pos);
+    *num = TUPLES_PER_CACHE - (pos & mgr->pos_mask);
+    return t;
+}
+
+void merge_member(cache_mgr_t *a, cache_mgr_t *b, uint32_t left, uint32_t mid, uint32_t right, cache_mgr_t *tmp) {
     uint32_t i = left;
     uint32_t j = mid;
     uint32_t k = left;
@@ -165,6 +175,82 @@ void merge(cache_mgr_t *a, cache_mgr_t *b, uint32_t left, uint32_t mid, uint32_t
     }
 }
 
+// one get_span() per block of each cursor, only the cursor that ran out
+// is refilled, tight loops in between
+void merge(cache_mgr_t *a, cache_mgr_t *b, uint32_t left, uint32_t mid, uint32_t right, cache_mgr_t *tmp) {
+    uint32_t i = left;
+    uint32_t j = mid;
+    uint32_t k = left;
+    uint32_t na = 0, nb = 0, nk = 0, n;
+    tuple_t *ai = NULL, *aj = NULL, *tmpk = NULL;
+
+    while (i < mid && j < right) {
+        if (na == 0) {
+            ai = get_span(a, i, &na);
+            if (na > mid - i)
+                na = mid - i;
+        }
+        if (nb == 0) {
+            aj = get_span(b, j, &nb);
+            if (nb > right - j)
+                nb = right - j;
+        }
+        if (nk == 0)
+            tmpk = get_span(tmp, k, &nk);
+
+        // until one of the three spans runs out
+        n = nk;
+        while (na && nb && nk) {
+            bool take_i = ai->key < aj->key;
+            *tmpk++ = take_i ? *ai : *aj;
+            ai += take_i;
+            aj += !take_i;
+            na -= take_i;
+            nb -= !take_i;
+            nk--;
+            i += take_i;
+            j += !take_i;
+        }
+        k += n - nk;
+    }
+
+    while (i < mid) {
+        if (na == 0) {
+            ai = get_span(a, i, &na);
+            if (na > mid - i)
+                na = mid - i;
+        }
+        if (nk == 0)
+            tmpk = get_span(tmp, k, &nk);
+        n = na < nk ? na : nk;
+        memcpy(tmpk, ai, n * sizeof(tuple_t));
+        ai += n;
+        tmpk += n;
+        na -= n;
+        nk -= n;
+        i += n;
+        k += n;
+    }
+
+    while (j < right) {
+        if (nb == 0) {
+            aj = get_span(b, j, &nb);
+            if (nb > right - j)
+                nb = right - j;
+        }
+        if (nk == 0)
+            tmpk = get_span(tmp, k, &nk);
+        n = nb < nk ? nb : nk;
+        memcpy(tmpk, aj, n * sizeof(tuple_t));
+        aj += n;
+        tmpk += n;
+        nb -= n;
+        nk -= n;
+        j += n;
+        k += n;
+    }
+}
+
 // non-recursive
 void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
     if (len <= 1)
@@ -197,7 +283,10 @@ void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
             if (right > len)
                 right = len;
 
-            merge(srca, srcb, i, mid, right, dst);
+            if (per_member)
+                merge_member(srca, srcb, i, mid, right, dst);
+            else
+                merge(srca, srcb, i, mid, right, dst);
         }
         //t = clock() - t;
         //printf("width: %d, time: %f ms\n", width, (float)t * 1000 / CLOCKS_PER_SEC);
@@ -209,19 +298,28 @@ void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
         memcpy(a, tmp, len * sizeof(tuple_t));
 }
 
-uint32_t merge_join(cache_mgr_t *r, cache_mgr_t *s, uint32_t num_r, uint32_t num_s, void *output) {
-    uint32_t i = 0, j = 0, matches = 0;
+// equal key groups count their full cross product like merge_join() in
+// merge_sort.c. r goes first on a tie, so when an s tuple is taken every r
+// tuple of its key has been, run_num of them in a row as the last ones
+uint64_t merge_join_member(cache_mgr_t *r, cache_mgr_t *s, uint32_t num_r, uint32_t num_s, void *output) {
+    uint32_t i = 0, j = 0, run_num = 0;
+    tuple_key_t run_key = 0;
+    uint64_t matches = 0;
     tuple_t *ri, *sj;
 
-    while (i < num_r && j < num_s) {
-        ri = get_member(r, i);
+    while (j < num_s) {
         sj = get_member(s, j);
-        if (ri->key < sj->key)
+        ri = i < num_r ? get_member(r, i) : NULL;
+        if (ri != NULL && ri->key <= sj->key) {
+            run_num = ri->key == run_key ? run_num + 1 : 1;
+            run_key = ri->key;
             i++;
-        else if (ri->key > sj->key)
-            j++;
+        }
+        else if (ri == NULL && (run_num == 0 || sj->key != run_key)) {
+            break;
+        }
         else {
-            matches++;
+            matches += sj->key == run_key ? run_num : 0;
             j++;
         }
     }
@@ -229,6 +327,60 @@ uint32_t merge_join(cache_mgr_t *r, cache_mgr_t *s, uint32_t num_r, uint32_t num
     return matches;
 }
 
+uint64_t merge_join(cache_mgr_t *r, cache_mgr_t *s, uint32_t num_r, uint32_t num_s, void *output) {
+    uint32_t i = 0, j = 0, run_num = 0;
+    tuple_key_t run_key = 0;
+    uint64_t matches = 0;
+    uint32_t nr = 0, ns = 0;
+    tuple_t *ri = NULL, *sj = NULL;
+
+    while (i < num_r && j < num_s) {
+        if (nr == 0) {
+            ri = get_span(r, i, &nr);
+            if (nr > num_r - i)
+                nr = num_r - i;
+        }
+        if (ns == 0) {
+            sj = get_span(s, j, &ns);
+            if (ns > num_s - j)
+                ns = num_s - j;
+        }
+
+        while (nr && ns) {
+            if (ri->key <= sj->key) {
+                run_num = ri->key == run_key ? run_num + 1 : 1;
+                run_key = ri->key;
+                ri++;
+                nr--;
+                i++;
+            }
+            else {
+                matches += sj->key == run_key ? run_num : 0;
+                sj++;
+                ns--;
+                j++;
+            }
+        }
+    }
+
+    // r is done, the s tuples of its last key still pair with the last run
+    while (run_num && j < num_s) {
+        if (ns == 0) {
+            sj = get_span(s, j, &ns);
+            if (ns > num_s - j)
+                ns = num_s - j;
+        }
+        if (sj->key != run_key)
+            break;
+        matches += run_num;
+        sj++;
+        ns--;
+        j++;
+    }
+
+    return matches;
+}
+
 #if 1 // change dataset
 
 void init_tuples(tuple_t *a, uint32_t size) {
@@ -311,13 +463,31 @@ void print_tuples(tuple_t *a, uint32_t size) {
 
 #endif
 
+void usage(const char *exec_name) {
+    printf("usage: %s [-g] tuples_size\n"
+           "\t-g \tone get_member() per tuple instead of per-block spans\n"
+           "\t-h \thelp\n", exec_name);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("usage: %s tuples_size", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "gh")) != -1) {
+        switch (opt) {
+        case 'g':
+            per_member = true;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return -1;
     }
 
-    int size = atoi(argv[1]);
+    int size = atoi(argv[optind]);
     assert(size > 0);
 
     srand(time(NULL));
@@ -351,10 +521,12 @@ int main(int argc, char *argv[]) {
 
     reset_cache(&cache[0], a, size, true);
     reset_cache(&cache[1], b, size, true);
-    uint32_t matches = merge_join(&cache[0], &cache[1], size, size, tmp);
+    uint64_t matches = per_member ? merge_join_member(&cache[0], &cache[1], size, size, tmp)
+                                  : merge_join(&cache[0], &cache[1], size, size, tmp);
 
     t = clock() - t;
-    printf("time: %f ms, matches: %u\n", (float)t * 1000 / CLOCKS_PER_SEC, matches);
+    printf("access: %s, time: %f ms, matches: %lu\n", per_member ? "member" : "span",
+           (float)t * 1000 / CLOCKS_PER_SEC, (unsigned long)matches);
 
     print_tuples(a, size);
     assert(is_tuples_sorted(a, size));
@@ -0,0 +1,584 @@
+// release: gcc -O3 -Wall -pthread -o ./merge_sort_external ./merge_sort_external.c -lrt
+// debug  : gcc -g -Wall -pthread -o ./merge_sort_external_debug ./merge_sort_external.c -lrt
+
+/*
+ * out-of-core sort and merge join over binary tuple_t files
+ *
+ * the input is read in memory-sized chunks, every chunk is sorted with
+ * merge_sort() and spilled to a run file, then the runs are kway merged with a
+ * loser tree. all reads and writes of the merge are double buffered through
+ * posix aio, so the disk works while the merge runs. tuple counts and file
+ * offsets are 64-bit everywhere.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <aio.h>
+#include <sys/stat.h>
+
+typedef uint32_t tuple_key_t;
+typedef uint32_t tuple_value_t;
+
+typedef struct  {
+    tuple_key_t   key;
+    tuple_value_t value;
+} tuple_t;
+
+void merge(tuple_t *a, uint32_t left, uint32_t mid, uint32_t right, tuple_t *tmp) {
+    uint32_t i = left;
+    uint32_t j = mid;
+    uint32_t k = left;
+
+    while (i < mid && j < right) {
+        if (a[i].key < a[j].key)
+            tmp[k++] = a[i++];
+        else
+            tmp[k++] = a[j++];
+    }
+
+    while (i < mid)
+        tmp[k++] = a[i++];
+
+    while (j < right)
+        tmp[k++] = a[j++];
+}
+
+// non-recursive
+void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
+    if (len <= 1)
+        return;
+
+    uint32_t toggle = 0;
+    tuple_t *src, *dst;
+    for (uint32_t width = 1; width < len; width <<= 1) {
+        if (toggle & 1) {
+            src = tmp;
+            dst = a;
+        }
+        else {
+            src = a;
+            dst = tmp;
+        }
+        for (uint32_t i = 0; i < len; i += (width << 1)) {
+            uint32_t mid = i + width;
+            if (mid > len)
+                mid = len;
+
+            uint32_t right = mid + width;
+            if (right > len)
+                right = len;
+
+            merge(src, i, mid, right, dst);
+        }
+        toggle++;
+    }
+
+    if (toggle & 1)
+        memcpy(a, tmp, len * sizeof(tuple_t));
+}
+
+/*
+ * double buffered streams
+ *
+ * a reader consumes one buffer while the next one is being read, a writer
+ * fills one buffer while the previous one is being written.
+ */
+
+static void aio_start(struct aiocb *cb, int fd, void *buf, uint64_t bytes, uint64_t off, bool write) {
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = fd;
+    cb->aio_buf = buf;
+    cb->aio_nbytes = bytes;
+    cb->aio_offset = off;
+
+    int ret = write ? aio_write(cb) : aio_read(cb);
+    assert(ret == 0);
+}
+
+static void aio_finish(struct aiocb *cb) {
+    const struct aiocb *list[1] = {cb};
+
+    while (aio_error(cb) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+
+    ssize_t ret = aio_return(cb);
+    assert(ret == (ssize_t)cb->aio_nbytes);
+}
+
+typedef struct {
+    int fd;
+    uint64_t next;          // next tuple of the file to request
+    uint64_t end;
+    uint64_t cap;           // tuples per buffer
+    tuple_t *buf[2];
+    uint32_t cur;           // buffer being consumed
+    uint64_t pos;
+    uint64_t cnt;
+    uint64_t pending_cnt;   // tuples being read into buf[cur ^ 1]
+    bool pending;
+    struct aiocb cb;
+} stream_reader_t;
+
+static void reader_request(stream_reader_t *r, uint32_t b) {
+    uint64_t n = r->end - r->next < r->cap ? r->end - r->next : r->cap;
+    if (n == 0)
+        return;
+
+    aio_start(&r->cb, r->fd, r->buf[b], n * sizeof(tuple_t), r->next * sizeof(tuple_t), false);
+    r->next += n;
+    r->pending_cnt = n;
+    r->pending = true;
+}
+
+// stream the tuples [begin, begin + num) of the file
+void reader_open(stream_reader_t *r, int fd, uint64_t begin, uint64_t num, uint64_t cap) {
+    r->fd = fd;
+    r->next = begin;
+    r->end = begin + num;
+    r->cap = cap;
+    r->buf[0] = malloc(cap * sizeof(tuple_t));
+    r->buf[1] = malloc(cap * sizeof(tuple_t));
+    assert(r->buf[0] != NULL && r->buf[1] != NULL);
+
+    r->cur = 1;
+    r->pos = r->cnt = 0;
+    r->pending = false;
+    reader_request(r, 0);
+}
+
+void reader_close(stream_reader_t *r) {
+    if (r->pending)
+        aio_finish(&r->cb);
+    free(r->buf[0]);
+    free(r->buf[1]);
+}
+
+// switch to the buffer read in the background and start reading the next one
+static bool reader_refill(stream_reader_t *r) {
+    if (!r->pending)
+        return false;
+
+    aio_finish(&r->cb);
+    r->pending = false;
+    r->cur ^= 1;
+    r->cnt = r->pending_cnt;
+    r->pos = 0;
+    reader_request(r, r->cur ^ 1);
+
+    return true;
+}
+
+// current tuple, NULL at the end of the stream
+static inline tuple_t *reader_peek(stream_reader_t *r) {
+    if (r->pos == r->cnt && !reader_refill(r))
+        return NULL;
+
+    return &r->buf[r->cur][r->pos];
+}
+
+typedef struct {
+    int fd;
+    uint64_t off;           // next tuple of the file to write
+    uint64_t cap;
+    tuple_t *buf[2];
+    uint32_t cur;
+    uint64_t cnt;
+    bool pending;
+    struct aiocb cb;
+} stream_writer_t;
+
+void writer_open(stream_writer_t *w, int fd, uint64_t begin, uint64_t cap) {
+    w->fd = fd;
+    w->off = begin;
+    w->cap = cap;
+    w->buf[0] = malloc(cap * sizeof(tuple_t));
+    w->buf[1] = malloc(cap * sizeof(tuple_t));
+    assert(w->buf[0] != NULL && w->buf[1] != NULL);
+
+    w->cur = 0;
+    w->cnt = 0;
+    w->pending = false;
+}
+
+static void writer_flush(stream_writer_t *w) {
+    if (w->pending)
+        aio_finish(&w->cb);
+    w->pending = false;
+
+    if (w->cnt == 0)
+        return;
+
+    aio_start(&w->cb, w->fd, w->buf[w->cur], w->cnt * sizeof(tuple_t), w->off * sizeof(tuple_t), true);
+    w->pending = true;
+    w->off += w->cnt;
+    w->cur ^= 1;
+    w->cnt = 0;
+}
+
+static inline void writer_put(stream_writer_t *w, const tuple_t *t) {
+    w->buf[w->cur][w->cnt++] = *t;
+    if (w->cnt == w->cap)
+        writer_flush(w);
+}
+
+void writer_close(stream_writer_t *w) {
+    writer_flush(w);
+    if (w->pending)
+        aio_finish(&w->cb);
+    free(w->buf[0]);
+    free(w->buf[1]);
+}
+
+/*
+ * kway merge of file runs with a loser tree
+ */
+
+#define EXT_MAX_FANIN   64
+#define EXT_MIN_BUF     (64 << 10)  // bytes per stream buffer at least
+#define KEY_EXHAUSTED   UINT64_MAX
+
+typedef struct {
+    uint64_t begin;
+    uint64_t num;
+} run_t;
+
+// widest merge whose 2 * (fanin + 1) buffers of EXT_MIN_BUF bytes fit in
+// mem_bytes, a smaller budget takes more passes instead of more memory
+uint32_t merge_fanin(uint64_t mem_bytes) {
+    uint64_t fanin = mem_bytes / (2 * EXT_MIN_BUF) - 1;
+    assert(mem_bytes >= 2 * EXT_MIN_BUF && fanin >= 2);
+
+    return fanin < EXT_MAX_FANIN ? (uint32_t)fanin : EXT_MAX_FANIN;
+}
+
+// merge the runs of fd_in into one run of fd_out starting at tuple out_begin
+void merge_file_runs(int fd_in, const run_t *runs, uint32_t run_num, int fd_out, uint64_t out_begin, uint64_t buf_tuples) {
+    uint32_t leaf_num = 1;
+    while (leaf_num < run_num)
+        leaf_num <<= 1;
+
+    stream_reader_t rd[run_num];
+    uint64_t key[leaf_num];
+    uint32_t node[leaf_num], w[leaf_num * 2];
+    stream_writer_t wr;
+
+    for (uint32_t i = 0; i < leaf_num; i++) {
+        key[i] = KEY_EXHAUSTED;
+        if (i < run_num) {
+            reader_open(&rd[i], fd_in, runs[i].begin, runs[i].num, buf_tuples);
+            tuple_t *t = reader_peek(&rd[i]);
+            if (t != NULL)
+                key[i] = t->key;
+        }
+        w[leaf_num + i] = i;
+    }
+    writer_open(&wr, fd_out, out_begin, buf_tuples);
+
+    for (uint32_t n = leaf_num - 1; n >= 1; n--) {
+        uint32_t l = w[n * 2], r = w[n * 2 + 1];
+        w[n] = key[r] < key[l] ? r : l;
+        node[n] = key[r] < key[l] ? l : r;
+    }
+    node[0] = leaf_num > 1 ? w[1] : 0;
+
+    while (key[node[0]] != KEY_EXHAUSTED) {
+        uint32_t win = node[0];
+        stream_reader_t *r = &rd[win];
+
+        writer_put(&wr, &r->buf[r->cur][r->pos]);
+        r->pos++;
+        tuple_t *t = reader_peek(r);
+        key[win] = t != NULL ? t->key : KEY_EXHAUSTED;
+
+        for (uint32_t n = (win + leaf_num) >> 1; n >= 1; n >>= 1) {
+            if (key[node[n]] < key[win]) {
+                uint32_t l = node[n];
+                node[n] = win;
+                win = l;
+            }
+        }
+        node[0] = win;
+    }
+
+    for (uint32_t i = 0; i < run_num; i++)
+        reader_close(&rd[i]);
+    writer_close(&wr);
+}
+
+// unlinked scratch file next to the output
+int open_spill_file(const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/merge_sort_spill.XXXXXX", dir);
+
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    return fd;
+}
+
+static inline unsigned long long my_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_nsec + (unsigned long long)t.tv_sec * 1000000000ULL;
+}
+
+uint64_t file_tuples(int fd) {
+    struct stat st;
+    int ret = fstat(fd, &st);
+    assert(ret == 0);
+    assert(st.st_size % sizeof(tuple_t) == 0);
+
+    return (uint64_t)st.st_size / sizeof(tuple_t);
+}
+
+static void read_full(int fd, void *buf, uint64_t bytes, uint64_t off) {
+    while (bytes) {
+        ssize_t ret = pread(fd, buf, bytes, off);
+        assert(ret > 0);
+        buf = (char *)buf + ret;
+        bytes -= ret;
+        off += ret;
+    }
+}
+
+static void write_full(int fd, const void *buf, uint64_t bytes, uint64_t off) {
+    while (bytes) {
+        ssize_t ret = pwrite(fd, buf, bytes, off);
+        assert(ret > 0);
+        buf = (const char *)buf + ret;
+        bytes -= ret;
+        off += ret;
+    }
+}
+
+// sort in_path into out_path using at most mem_bytes of buffers
+void external_sort(const char *in_path, const char *out_path, uint64_t mem_bytes, const char *spill_dir) {
+    int fd_in = open(in_path, O_RDONLY);
+    assert(fd_in >= 0);
+    int fd_out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd_out >= 0);
+
+    uint64_t num = file_tuples(fd_in);
+    uint64_t chunk = mem_bytes / 2 / sizeof(tuple_t);  // the other half is tmp
+    if (chunk > UINT32_MAX)
+        chunk = UINT32_MAX;
+    assert(chunk > 0);
+
+    unsigned long long t = my_clock();
+
+    // phase 1: sorted runs, straight into the output when everything fits
+    uint32_t run_num = (uint32_t)((num + chunk - 1) / chunk);
+    run_t *runs = malloc((run_num + 1) * sizeof(run_t));
+    tuple_t *a = malloc(chunk * sizeof(tuple_t));
+    tuple_t *tmp = malloc(chunk * sizeof(tuple_t));
+    assert(runs != NULL && a != NULL && tmp != NULL);
+
+    uint32_t max_fanin = merge_fanin(mem_bytes);
+    int spill[2] = {-1, -1};
+    if (run_num > 1)
+        spill[0] = open_spill_file(spill_dir);
+    if (run_num > max_fanin)
+        spill[1] = open_spill_file(spill_dir);
+
+    int fd_run = run_num > 1 ? spill[0] : fd_out;
+    for (uint32_t i = 0; i < run_num; i++) {
+        runs[i].begin = i * chunk;
+        runs[i].num = num - runs[i].begin < chunk ? num - runs[i].begin : chunk;
+        read_full(fd_in, a, runs[i].num * sizeof(tuple_t), runs[i].begin * sizeof(tuple_t));
+        merge_sort(a, (uint32_t)runs[i].num, tmp);
+        write_full(fd_run, a, runs[i].num * sizeof(tuple_t), runs[i].begin * sizeof(tuple_t));
+    }
+    free(a);
+    free(tmp);
+
+    printf("%s: %lu tuples, %u runs, run phase: %f ms\n", in_path, (unsigned long)num, run_num,
+           (float)(my_clock() - t) / 1000000);
+
+    // phase 2: merge passes until one run is left, the last one writes the output
+    uint32_t passes = 0;
+    int fd_other = spill[1];
+    while (run_num > 1) {
+        uint32_t fanin = run_num < max_fanin ? run_num : max_fanin;
+        uint64_t buf_tuples = mem_bytes / (2 * (fanin + 1)) / sizeof(tuple_t);
+        assert(buf_tuples * sizeof(tuple_t) >= EXT_MIN_BUF);
+
+        int fd_dst = run_num <= max_fanin ? fd_out : fd_other;
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < run_num; i += fanin) {
+            uint32_t n = run_num - i < fanin ? run_num - i : fanin;
+            uint64_t begin = runs[i].begin;
+            uint64_t total = runs[i + n - 1].begin + runs[i + n - 1].num - begin;
+
+            merge_file_runs(fd_run, &runs[i], n, fd_dst, begin, buf_tuples);
+            runs[next].begin = begin;
+            runs[next].num = total;
+            next++;
+        }
+        run_num = next;
+        passes++;
+
+        fd_other = fd_run;
+        fd_run = fd_dst;
+    }
+
+    printf("%s: sorted into %s, fanin: %u, merge passes: %u, time: %f ms\n", in_path, out_path, max_fanin, passes,
+           (float)(my_clock() - t) / 1000000);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        if (spill[i] >= 0)
+            close(spill[i]);
+    }
+    free(runs);
+    close(fd_in);
+    close(fd_out);
+}
+
+// stream both sorted files, count the matches and check the order on the way
+uint64_t external_merge_join(const char *r_path, const char *s_path, uint64_t buf_tuples) {
+    int fd_r = open(r_path, O_RDONLY);
+    int fd_s = open(s_path, O_RDONLY);
+    assert(fd_r >= 0 && fd_s >= 0);
+
+    stream_reader_t r, s;
+    reader_open(&r, fd_r, 0, file_tuples(fd_r), buf_tuples);
+    reader_open(&s, fd_s, 0, file_tuples(fd_s), buf_tuples);
+
+    uint64_t matches = 0;
+    tuple_t *ri = reader_peek(&r), *sj = reader_peek(&s);
+    tuple_key_t last_r = 0, last_s = 0;
+    while (ri != NULL && sj != NULL) {
+        assert(ri->key >= last_r && sj->key >= last_s);
+        last_r = ri->key;
+        last_s = sj->key;
+
+        if (ri->key < sj->key) {
+            r.pos++;
+            ri = reader_peek(&r);
+        }
+        else if (ri->key > sj->key) {
+            s.pos++;
+            sj = reader_peek(&s);
+        }
+        else {
+            // equal key groups count their full cross product like merge_join()
+            tuple_key_t key = ri->key;
+            uint64_t group_r = 0, group_s = 0;
+            for (; ri != NULL && ri->key == key; ri = reader_peek(&r)) {
+                group_r++;
+                r.pos++;
+            }
+            for (; sj != NULL && sj->key == key; sj = reader_peek(&s)) {
+                group_s++;
+                s.pos++;
+            }
+            matches += group_r * group_s;
+        }
+    }
+
+    reader_close(&r);
+    reader_close(&s);
+    close(fd_r);
+    close(fd_s);
+
+    return matches;
+}
+
+// keys are a permutation of the 32-bit space, unique while num <= 2^32
+void generate_file(const char *path, uint64_t num, uint32_t seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    uint64_t chunk = 1 << 20;
+    tuple_t *buf = malloc(chunk * sizeof(tuple_t));
+    assert(buf != NULL);
+
+    for (uint64_t i = 0; i < num; i += chunk) {
+        uint64_t n = num - i < chunk ? num - i : chunk;
+        for (uint64_t j = 0; j < n; j++) {
+            buf[j].key = (uint32_t)((i + j) * 2654435761u) ^ seed;
+            buf[j].value = (uint32_t)(i + j);
+        }
+        write_full(fd, buf, n * sizeof(tuple_t), i * sizeof(tuple_t));
+    }
+
+    free(buf);
+    close(fd);
+}
+
+#define DEFAULT_MEM_MB 1024
+
+void usage(const char *exec_name) {
+    printf("usage: %s [-m mem_mb] [-g tuples_size] [-d spill_dir] r_file s_file\n"
+           "\t-m \tmemory for sorting in MB (default: %u)\n"
+           "\t-g \tfirst generate r_file and s_file with tuples_size tuples each\n"
+           "\t-d \tdirectory of the spill files (default: '.')\n",
+           exec_name, DEFAULT_MEM_MB);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t mem_bytes = (uint64_t)DEFAULT_MEM_MB << 20;
+    uint64_t gen_num = 0;
+    const char *spill_dir = ".";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:g:d:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_bytes = strtoull(optarg, NULL, 10) << 20;
+            assert(mem_bytes > 0);
+            break;
+        case 'g':
+            gen_num = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            spill_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind + 2 > argc) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    const char *r_path = argv[optind];
+    const char *s_path = argv[optind + 1];
+    char r_sorted[4096], s_sorted[4096];
+    snprintf(r_sorted, sizeof(r_sorted), "%s.sorted", r_path);
+    snprintf(s_sorted, sizeof(s_sorted), "%s.sorted", s_path);
+
+    if (gen_num) {
+        generate_file(r_path, gen_num, 0);
+        generate_file(s_path, gen_num, 0);
+        printf("generated %lu tuples, %f MB per file\n", (unsigned long)gen_num,
+               (float)gen_num * sizeof(tuple_t) / 1024 / 1024);
+    }
+
+    printf("begin external merge sort and merge join, memory: %lu MB\n", (unsigned long)(mem_bytes >> 20));
+
+    unsigned long long t = my_clock();
+    external_sort(r_path, r_sorted, mem_bytes, spill_dir);
+    external_sort(s_path, s_sorted, mem_bytes, spill_dir);
+
+    // the join streams four buffers, they stay within the budget as well
+    uint64_t join_buf = mem_bytes / 4 < EXT_MIN_BUF * 16 ? mem_bytes / 4 : EXT_MIN_BUF * 16;
+    uint64_t matches = external_merge_join(r_sorted, s_sorted, join_buf / sizeof(tuple_t));
+
+    t = my_clock() - t;
+    printf("time: %f ms, matches: %lu\n", (float)t / 1000000, (unsigned long)matches);
+
+    return 0;
+}
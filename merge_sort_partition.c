@@ -1,5 +1,5 @@
-// release: gcc -O3 -Wall -o ./merge_sort ./merge_sort.c
-// debug  : gcc -g -Wall -o ./merge_sort_debug ./merge_sort.c
+// release: gcc -O3 -Wall -pthread -o ./merge_sort ./merge_sort.c -lm
+// debug  : gcc -g -Wall -pthread -o ./merge_sort_debug ./merge_sort.c -lm
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +8,10 @@
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 typedef uint32_t tuple_key_t;
 typedef uint32_t tuple_value_t;
@@ -95,8 +99,11 @@ void merge_sort(tuple_t *a, uint32_t len, tuple_t *tmp) {
 
 #endif
 
-uint32_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, void *output) {
-    uint32_t i = 0, j = 0, matches = 0;
+// count the matches of sorted r and s, equal key groups on both sides count
+// their full cross product like merge_join() in merge_sort.c and hash_join()
+uint64_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, void *output) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
 
     while (i < num_r && j < num_s) {
         if (r[i].key < s[j].key)
@@ -104,27 +111,759 @@ uint32_t merge_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, void
         else if (r[i].key > s[j].key)
             j++;
         else {
-            matches++;
-            j++;
+            uint32_t ie = i + 1, je = j + 1;
+            while (ie < num_r && r[ie].key == r[i].key)
+                ie++;
+            while (je < num_s && s[je].key == s[j].key)
+                je++;
+            matches += (uint64_t)(ie - i) * (je - j);
+            i = ie;
+            j = je;
         }
     }
 
     return matches;
 }
 
-void partition_tuples(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num, uint32_t par_off, uint32_t par_size) {
-    uint32_t offset[par_num];
-   
-    for (uint32_t i = 0; i < par_num; i++) {
-        offset[i] = par_off + i * par_size;
+/*
+ * histogram radix partitioning
+ *
+ * a histogram pass counts the tuples of every partition, the prefix sum
+ * gives exact partition offsets, and the scatter writes every tuple to its
+ * place. the partition id is the low bits of the key, par_num is
+ * a power of two, and every partition is written through a cache line buffer
+ * (software write-combining) so the output goes out one full line at a time.
+ */
+
+#define SWWC_TUPLES (64 / sizeof(tuple_t))
+
+typedef struct {
+    tuple_t t[SWWC_TUPLES];
+} __attribute__((aligned(64))) swwc_line_t;
+
+// hist[p] += number of tuples of a in partition p, p = (key >> shift) & mask
+void partition_histogram(const tuple_t *a, uint32_t size, uint32_t shift, uint32_t mask, uint32_t *hist) {
+    for (uint32_t i = 0; i < size; i++)
+        hist[(a[i].key >> shift) & mask]++;
+}
+
+// write t to position pos of partition p, a full line goes out in one copy.
+// start[p] is where the range of this scatter begins in partition p
+static inline void swwc_put(tuple_t *par, swwc_line_t *line, uint32_t p, uint32_t pos, const uint32_t *start,
+                            tuple_t t) {
+    uint32_t slot = pos & (SWWC_TUPLES - 1);
+
+    line[p].t[slot] = t;
+    if (slot == SWWC_TUPLES - 1) {
+        if (pos + 1 - start[p] >= SWWC_TUPLES)
+            memcpy(&par[pos + 1 - SWWC_TUPLES], line[p].t, sizeof(swwc_line_t));
+        else // first line of the range starts in the middle
+            memcpy(&par[start[p]], &line[p].t[start[p] & (SWWC_TUPLES - 1)], (pos + 1 - start[p]) * sizeof(tuple_t));
+    }
+}
+
+// flush the partially filled lines
+static inline void swwc_flush(tuple_t *par, swwc_line_t *line, uint32_t par_num, const uint32_t *offset,
+                              const uint32_t *start) {
+    for (uint32_t p = 0; p < par_num; p++) {
+        uint32_t end = offset[p];
+        uint32_t begin = end & ~(uint32_t)(SWWC_TUPLES - 1);
+        if (begin < start[p])
+            begin = start[p];
+        if (begin < end)
+            memcpy(&par[begin], &line[p].t[begin & (SWWC_TUPLES - 1)], (end - begin) * sizeof(tuple_t));
+    }
+}
+
+// scatter a into par, partition p is written from offset[p] on, start[p] is
+// where the range of this scatter begins in partition p. offset is advanced
+void partition_scatter(const tuple_t *a, uint32_t size, tuple_t *par, uint32_t shift, uint32_t mask,
+                       uint32_t *offset, const uint32_t *start, swwc_line_t *line) {
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t p = (a[i].key >> shift) & mask;
+        swwc_put(par, line, p, offset[p]++, start, a[i]);
+    }
+
+    swwc_flush(par, line, mask + 1, offset, start);
+}
+
+// partition a into 2^bits partitions of par, partition p is par[begin[p], begin[p + 1])
+void partition_radix(const tuple_t *a, uint32_t size, tuple_t *par, uint32_t bits, uint32_t *begin) {
+    uint32_t par_num = 1u << bits;
+    uint32_t *hist = calloc(par_num, sizeof(uint32_t));
+    uint32_t *offset = malloc(par_num * sizeof(uint32_t));
+    swwc_line_t *line = aligned_alloc(64, par_num * sizeof(swwc_line_t));
+    assert(hist != NULL && offset != NULL && line != NULL);
+
+    partition_histogram(a, size, 0, par_num - 1, hist);
+
+    uint32_t sum = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        begin[p] = offset[p] = sum;
+        sum += hist[p];
+    }
+    begin[par_num] = sum;
+
+    partition_scatter(a, size, par, 0, par_num - 1, offset, begin, line);
+
+    free(hist);
+    free(offset);
+    free(line);
+}
+
+/*
+ * multi-level radix partitioning
+ *
+ * one pass over many partitions misses the tlb on every write once there are
+ * more partitions than tlb entries, and the write-combining lines no longer
+ * fit in l1. so the fanout of a pass is bounded by the l1 data cache (two
+ * lines per partition, one filling and one going out) and, with 4KB pages, by
+ * the l1 dtlb. the number of partitions is picked so that the r and s side of
+ * a partition pair and the sort scratch fit in l2, and every pass splits each
+ * partition of the previous pass on the next key bits. the passes go back and
+ * forth between par and tmp and the last one writes par.
+ */
+
+#define DTLB_ENTRIES    64        // l1 dtlb of 4KB pages on current x86 cores
+#define HUGE_PAGE_SIZE  (2 << 20)
+
+static uint32_t log2_floor(uint32_t n) {
+    uint32_t l = 0;
+    while (n >>= 1)
+        l++;
+    return l;
+}
+
+// cache sizes from the c library, typical x86 values when it does not know
+uint32_t detect_cache_size(int name, uint32_t fallback) {
+    long size = sysconf(name);
+    return size > 0 ? (uint32_t)size : fallback;
+}
+
+// largest fanout of one pass, as bits
+uint32_t pass_fanout_bits(uint32_t l1d_size, bool huge) {
+    uint32_t bits = log2_floor(l1d_size / sizeof(swwc_line_t) / 2);
+    if (!huge && bits > log2_floor(DTLB_ENTRIES))
+        bits = log2_floor(DTLB_ENTRIES);
+    return bits;
+}
+
+// partition bits so that r, s and the sort scratch of a partition fit in l2
+uint32_t l2_partition_bits(uint32_t size, uint32_t l2_size) {
+    uint32_t bits = 0;
+    while (((uint64_t)size * sizeof(tuple_t) >> bits) > l2_size / 4)
+        bits++;
+    return bits;
+}
+
+// buffers of 2MB pages when huge, transparent huge pages do not need a reserved pool
+void *alloc_partition_buffer(size_t bytes, bool huge) {
+    size_t align = huge ? HUGE_PAGE_SIZE : 64;
+    bytes = (bytes + align - 1) / align * align;
+    void *p = aligned_alloc(align, bytes);
+    assert(p != NULL);
+    if (huge)
+        madvise(p, bytes, MADV_HUGEPAGE);
+    return p;
+}
+
+// partition a into 2^bits partitions of par in passes of at most pass_bits,
+// partition p is par[begin[p], begin[p + 1]). tmp holds size tuples
+uint32_t partition_multi_level(const tuple_t *a, uint32_t size, tuple_t *par, tuple_t *tmp, uint32_t bits,
+                               uint32_t pass_bits, uint32_t *begin) {
+    uint32_t passes = (bits + pass_bits - 1) / pass_bits;
+    begin[0] = 0;
+    begin[1] = size;
+    if (passes == 0) {
+        memcpy(par, a, size * sizeof(tuple_t));
+        return 0;
+    }
+
+    uint32_t par_num = 1u << bits;
+    uint32_t fanout = 1u << ((bits + passes - 1) / passes);
+    uint32_t *next = malloc((par_num + 1) * sizeof(uint32_t));
+    uint32_t *hist = malloc(fanout * sizeof(uint32_t));
+    uint32_t *offset = malloc(fanout * sizeof(uint32_t));
+    swwc_line_t *line = aligned_alloc(64, fanout * sizeof(swwc_line_t));
+    assert(next != NULL && hist != NULL && offset != NULL && line != NULL);
+
+    const tuple_t *src = a;
+    uint32_t num = 1, shift = 0;
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        // the bits left are spread evenly over the passes left
+        uint32_t b = (bits - shift + (passes - pass) - 1) / (passes - pass);
+        uint32_t mask = (1u << b) - 1;
+        tuple_t *dst = (passes - 1 - pass) % 2 == 0 ? par : tmp;
+
+        for (uint32_t j = 0; j < num; j++) {
+            uint32_t off = begin[j], n = begin[j + 1] - off;
+            memset(hist, 0, (mask + 1) * sizeof(uint32_t));
+            partition_histogram(&src[off], n, shift, mask, hist);
+
+            uint32_t sum = off;
+            for (uint32_t p = 0; p <= mask; p++) {
+                next[(j << b) + p] = offset[p] = sum;
+                sum += hist[p];
+            }
+            partition_scatter(&src[off], n, dst, shift, mask, offset, &next[j << b], line);
+        }
+
+        num <<= b;
+        next[num] = size;
+        memcpy(begin, next, (num + 1) * sizeof(uint32_t));
+        shift += b;
+        src = dst;
+    }
+
+    free(next);
+    free(hist);
+    free(offset);
+    free(line);
+    return passes;
+}
+
+/*
+ * sample-based range partitioning
+ *
+ * partitioning on the low key bits spreads every key range over all the
+ * partitions, so the sorted partitions are only good for a join. here the
+ * par_num - 1 splitters come from a sorted random sample of the input and
+ * partition p gets the keys in [splitter[p - 1], splitter[p]). sorting every
+ * partition on its own then gives one sorted relation when the partitions are
+ * concatenated, and a second relation partitioned with the same splitters
+ * still joins partition by partition. the splitters are kept as an eytzinger
+ * tree (node 1 is the root, the children of node k are 2k and 2k + 1), so the
+ * search is bits steps of one compare and one shift, no branches.
+ */
+
+#define RANGE_OVERSAMPLE 256  // samples per partition
+
+// fill the subtree of node k in order from sorted[i] on, returns the next unused i
+static uint32_t eytzinger_fill(tuple_key_t *tree, uint32_t n, const tuple_key_t *sorted, uint32_t i, uint32_t k) {
+    if (k <= n) {
+        i = eytzinger_fill(tree, n, sorted, i, 2 * k);
+        tree[k] = sorted[i++];
+        i = eytzinger_fill(tree, n, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+// tree[1 .. 2^bits - 1] gets the splitters of 2^bits equal ranges of a sample of a
+void sample_splitters(const tuple_t *a, uint32_t size, uint32_t bits, tuple_key_t *tree) {
+    uint32_t par_num = 1u << bits;
+    uint32_t num = par_num * RANGE_OVERSAMPLE;
+    tuple_t *sample = malloc(num * sizeof(tuple_t) * 2);
+    tuple_key_t *splitter = malloc(par_num * sizeof(tuple_key_t));
+    assert(sample != NULL && splitter != NULL);
+
+    for (uint32_t i = 0; i < num; i++)
+        sample[i] = a[rand() % size];
+    merge_sort(sample, num, &sample[num]);
+
+    for (uint32_t p = 1; p < par_num; p++)
+        splitter[p - 1] = sample[(uint64_t)p * num / par_num].key;
+    eytzinger_fill(tree, par_num - 1, splitter, 0, 1);
+
+    free(sample);
+    free(splitter);
+}
+
+// number of splitters <= key
+static inline uint32_t range_partition_id(const tuple_key_t *tree, uint32_t bits, tuple_key_t key) {
+    uint32_t k = 1;
+    for (uint32_t l = 0; l < bits; l++)
+        k = 2 * k + (key >= tree[k]);
+    return k - (1u << bits);
+}
+
+void partition_range_histogram(const tuple_t *a, uint32_t size, const tuple_key_t *tree, uint32_t bits,
+                               uint32_t *hist) {
+    for (uint32_t i = 0; i < size; i++)
+        hist[range_partition_id(tree, bits, a[i].key)]++;
+}
+
+void partition_range_scatter(const tuple_t *a, uint32_t size, tuple_t *par, const tuple_key_t *tree, uint32_t bits,
+                             uint32_t *offset, const uint32_t *start, swwc_line_t *line) {
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t p = range_partition_id(tree, bits, a[i].key);
+        swwc_put(par, line, p, offset[p]++, start, a[i]);
+    }
+
+    swwc_flush(par, line, 1u << bits, offset, start);
+}
+
+// partition a by the splitters of tree, partition p is par[begin[p], begin[p + 1])
+void partition_range(const tuple_t *a, uint32_t size, tuple_t *par, uint32_t bits, const tuple_key_t *tree,
+                     uint32_t *begin) {
+    uint32_t par_num = 1u << bits;
+    uint32_t *hist = calloc(par_num, sizeof(uint32_t));
+    uint32_t *offset = malloc(par_num * sizeof(uint32_t));
+    swwc_line_t *line = aligned_alloc(64, par_num * sizeof(swwc_line_t));
+    assert(hist != NULL && offset != NULL && line != NULL);
+
+    partition_range_histogram(a, size, tree, bits, hist);
+
+    uint32_t sum = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        begin[p] = offset[p] = sum;
+        sum += hist[p];
+    }
+    begin[par_num] = sum;
+
+    partition_range_scatter(a, size, par, tree, bits, offset, begin, line);
+
+    free(hist);
+    free(offset);
+    free(line);
+}
+
+/*
+ * parallel radix and range partitioning
+ *
+ * every thread builds the histogram of its own chunk of the input. after a
+ * barrier one thread turns all histograms into write offsets: in every
+ * partition the range of thread 0 comes first, then thread 1 and so on. each
+ * thread then scatters its chunk into its own exclusive ranges, no atomics.
+ */
+
+typedef struct {
+    const tuple_t *a;
+    uint32_t size;
+    tuple_t *par;
+    uint32_t bits;
+    uint32_t par_num;
+    const tuple_key_t *tree;  // range splitters, radix partitioning when NULL
+    uint32_t *begin;
+    uint32_t *hist;   // thread_num x par_num, becomes the write offsets
+    uint32_t *start;  // thread_num x par_num
+    uint32_t thread_num;
+    pthread_barrier_t barrier;
+} par_partition_ctx_t;
+
+typedef struct {
+    par_partition_ctx_t *ctx;
+    uint32_t id;
+    pthread_t thread;
+} par_partition_arg_t;
+
+void *partition_worker(void *arg) {
+    par_partition_arg_t *par = arg;
+    par_partition_ctx_t *ctx = par->ctx;
+    uint32_t num = ctx->thread_num, par_num = ctx->par_num;
+    uint32_t k0 = (uint32_t)((uint64_t)ctx->size * par->id / num);
+    uint32_t k1 = (uint32_t)((uint64_t)ctx->size * (par->id + 1) / num);
+    uint32_t *hist = &ctx->hist[par->id * par_num];
+
+    memset(hist, 0, par_num * sizeof(uint32_t));
+    if (ctx->tree != NULL)
+        partition_range_histogram(&ctx->a[k0], k1 - k0, ctx->tree, ctx->bits, hist);
+    else
+        partition_histogram(&ctx->a[k0], k1 - k0, 0, par_num - 1, hist);
+
+    pthread_barrier_wait(&ctx->barrier);
+    if (par->id == 0) {
+        uint32_t sum = 0;
+        for (uint32_t p = 0; p < par_num; p++) {
+            ctx->begin[p] = sum;
+            for (uint32_t t = 0; t < num; t++) {
+                uint32_t n = ctx->hist[t * par_num + p];
+                ctx->hist[t * par_num + p] = ctx->start[t * par_num + p] = sum;
+                sum += n;
+            }
+        }
+        ctx->begin[par_num] = sum;
+    }
+    pthread_barrier_wait(&ctx->barrier);
+
+    swwc_line_t *line = aligned_alloc(64, par_num * sizeof(swwc_line_t));
+    assert(line != NULL);
+    if (ctx->tree != NULL)
+        partition_range_scatter(&ctx->a[k0], k1 - k0, ctx->par, ctx->tree, ctx->bits, hist,
+                                &ctx->start[par->id * par_num], line);
+    else
+        partition_scatter(&ctx->a[k0], k1 - k0, ctx->par, 0, par_num - 1, hist, &ctx->start[par->id * par_num], line);
+    free(line);
+
+    return NULL;
+}
+
+static void run_partition_workers(par_partition_ctx_t *ctx) {
+    uint32_t thread_num = ctx->thread_num;
+
+    ctx->hist = malloc(thread_num * ctx->par_num * sizeof(uint32_t));
+    ctx->start = malloc(thread_num * ctx->par_num * sizeof(uint32_t));
+    assert(ctx->hist != NULL && ctx->start != NULL);
+    pthread_barrier_init(&ctx->barrier, NULL, thread_num);
+
+    par_partition_arg_t args[thread_num];
+    for (uint32_t i = 0; i < thread_num; i++) {
+        args[i].ctx = ctx;
+        args[i].id = i;
+        int ret = pthread_create(&args[i].thread, NULL, partition_worker, &args[i]);
+        assert(ret == 0);
+    }
+
+    for (uint32_t i = 0; i < thread_num; i++)
+        pthread_join(args[i].thread, NULL);
+
+    pthread_barrier_destroy(&ctx->barrier);
+    free(ctx->hist);
+    free(ctx->start);
+}
+
+void partition_radix_parallel(const tuple_t *a, uint32_t size, tuple_t *par, uint32_t bits, uint32_t *begin,
+                              uint32_t thread_num) {
+    if (thread_num <= 1) {
+        partition_radix(a, size, par, bits, begin);
+        return;
+    }
+
+    par_partition_ctx_t ctx = {.a = a, .size = size, .par = par, .bits = bits, .par_num = 1u << bits,
+                               .begin = begin, .thread_num = thread_num};
+    run_partition_workers(&ctx);
+}
+
+void partition_range_parallel(const tuple_t *a, uint32_t size, tuple_t *par, uint32_t bits, const tuple_key_t *tree,
+                              uint32_t *begin, uint32_t thread_num) {
+    if (thread_num <= 1) {
+        partition_range(a, size, par, bits, tree, begin);
+        return;
+    }
+
+    par_partition_ctx_t ctx = {.a = a, .size = size, .par = par, .bits = bits, .par_num = 1u << bits,
+                               .tree = tree, .begin = begin, .thread_num = thread_num};
+    run_partition_workers(&ctx);
+}
+
+/*
+ * radix partitioned hash join
+ *
+ * both relations go through partition_radix() into the same cache-sized
+ * partition pairs, then every pair builds an open addressing table on its r
+ * side and probes it with the s side. a slot holds the row + 1 of a build
+ * tuple, 0 is empty, so the table is 4 bytes per slot and duplicate keys are
+ * just more slots of the same probe chain. the partitions come out unsorted.
+ */
+
+static inline uint32_t hash_key(tuple_key_t key, uint32_t bits) {
+    // the partition id took the low bits, fibonacci hashing mixes in the rest
+    return (uint32_t)(key * 2654435761u) >> (32 - bits);
+}
+
+// smallest table of at least twice num slots
+uint32_t hash_table_bits(uint32_t num) {
+    uint32_t bits = 4;
+    while ((1u << bits) < num * 2)
+        bits++;
+    return bits;
+}
+
+uint64_t hash_join(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, uint32_t *table) {
+    uint32_t bits = hash_table_bits(num_r);
+    uint32_t mask = (1u << bits) - 1;
+    uint64_t matches = 0;
+
+    memset(table, 0, sizeof(uint32_t) << bits);
+    for (uint32_t i = 0; i < num_r; i++) {
+        uint32_t h = hash_key(r[i].key, bits);
+        while (table[h] != 0)
+            h = (h + 1) & mask;
+        table[h] = i + 1;
+    }
+
+    for (uint32_t j = 0; j < num_s; j++) {
+        for (uint32_t h = hash_key(s[j].key, bits); table[h] != 0; h = (h + 1) & mask)
+            matches += r[table[h] - 1].key == s[j].key;
+    }
+
+    return matches;
+}
+
+/*
+ * skew-aware partitioning
+ *
+ * with zipf keys a few hot keys fill one partition, and its sort and join
+ * take most of the time. a sample of both relations finds the heavy keys,
+ * then one pass measures the exact size of every heavy key and of every fine
+ * radix bucket (SKEW_FINE_BITS more bits than the partition id). a heavy key
+ * is cut into pieces: its s tuples are dealt round robin over the pieces and
+ * its r tuples are copied into every piece, so every r x s pair still meets
+ * exactly once. the pieces go to the least loaded partitions first, then the
+ * buckets, largest first, so the partitions are balanced by measured size.
+ */
+
+#define SKEW_OVERSAMPLE 256  // samples of each relation per partition
+#define SKEW_FINE_BITS  4
+
+typedef struct {
+    tuple_key_t key;
+    uint32_t r_num;
+    uint32_t s_num;
+    uint32_t piece;      // first partition of the key in piece_par
+    uint32_t piece_num;
+} heavy_key_t;
+
+typedef struct {
+    uint32_t bits;         // 2^bits partitions
+    uint32_t *bucket_par;  // partition of every fine bucket
+    heavy_key_t *heavy;
+    uint32_t heavy_num;
+    uint32_t *slot;        // heavy index + 1, 0 is empty
+    uint32_t slot_bits;
+    uint32_t *piece_par;
+} skew_plan_t;
+
+static inline heavy_key_t *find_heavy(const skew_plan_t *plan, tuple_key_t key) {
+    uint32_t mask = (1u << plan->slot_bits) - 1;
+    for (uint32_t h = hash_key(key, plan->slot_bits); plan->slot[h] != 0; h = (h + 1) & mask) {
+        if (plan->heavy[plan->slot[h] - 1].key == key)
+            return &plan->heavy[plan->slot[h] - 1];
+    }
+    return NULL;
+}
+
+static inline uint32_t least_loaded(const uint64_t *load, uint32_t par_num, const uint32_t *taken, uint32_t stamp) {
+    uint32_t best = UINT32_MAX;
+    for (uint32_t p = 0; p < par_num; p++) {
+        if ((taken == NULL || taken[p] != stamp) && (best == UINT32_MAX || load[p] < load[best]))
+            best = p;
+    }
+    return best;
+}
+
+typedef struct {
+    uint32_t num;
+    uint32_t bucket;
+} bucket_size_t;
+
+static int bucket_size_desc(const void *x, const void *y) {
+    uint32_t a = ((const bucket_size_t *)x)->num, b = ((const bucket_size_t *)y)->num;
+    return (a < b) - (a > b);
+}
+
+static int heavy_load_desc(const void *x, const void *y) {
+    const heavy_key_t *a = x, *b = y;
+    uint64_t la = (uint64_t)a->r_num + a->s_num, lb = (uint64_t)b->r_num + b->s_num;
+    return (la < lb) - (la > lb);
+}
+
+void plan_skew(const tuple_t *r, uint32_t num_r, const tuple_t *s, uint32_t num_s, uint32_t bits,
+               skew_plan_t *plan) {
+    uint32_t par_num = 1u << bits;
+    uint32_t num = par_num * SKEW_OVERSAMPLE;
+    uint32_t fine_num = 1u << (bits + SKEW_FINE_BITS);
+
+    // heavy keys: at least SKEW_OVERSAMPLE / 2 hits, about a quarter of a partition
+    tuple_t *sample = malloc(num * sizeof(tuple_t) * 4);
+    assert(sample != NULL);
+    for (uint32_t i = 0; i < num; i++) {
+        sample[i] = r[rand() % num_r];
+        sample[num + i] = s[rand() % num_s];
+    }
+    merge_sort(sample, num * 2, &sample[num * 2]);
+
+    plan->bits = bits;
+    plan->heavy = malloc(par_num * 4 * sizeof(heavy_key_t));
+    plan->heavy_num = 0;
+    assert(plan->heavy != NULL);
+    for (uint32_t i = 0, j; i < num * 2; i = j) {
+        for (j = i + 1; j < num * 2 && sample[j].key == sample[i].key; j++)
+            ;
+        if (j - i >= SKEW_OVERSAMPLE / 2)
+            plan->heavy[plan->heavy_num++] = (heavy_key_t){.key = sample[i].key};
+    }
+    free(sample);
+
+    // exact sizes of the heavy keys and of the fine buckets of all other keys
+    uint32_t *bucket_num = calloc(fine_num, sizeof(uint32_t));
+    plan->slot_bits = hash_table_bits(plan->heavy_num);
+    plan->slot = calloc(1u << plan->slot_bits, sizeof(uint32_t));
+    assert(bucket_num != NULL && plan->slot != NULL);
+    for (uint32_t i = 0; i < plan->heavy_num; i++) {
+        uint32_t h = hash_key(plan->heavy[i].key, plan->slot_bits);
+        while (plan->slot[h] != 0)
+            h = (h + 1) & ((1u << plan->slot_bits) - 1);
+        plan->slot[h] = i + 1;
+    }
+    for (uint32_t i = 0; i < num_r; i++) {
+        heavy_key_t *h = find_heavy(plan, r[i].key);
+        if (h != NULL)
+            h->r_num++;
+        else
+            bucket_num[r[i].key & (fine_num - 1)]++;
+    }
+    for (uint32_t i = 0; i < num_s; i++) {
+        heavy_key_t *h = find_heavy(plan, s[i].key);
+        if (h != NULL)
+            h->s_num++;
+        else
+            bucket_num[s[i].key & (fine_num - 1)]++;
+    }
+
+    // sorting the heavy keys moves them, so the slots are rebuilt after
+    qsort(plan->heavy, plan->heavy_num, sizeof(heavy_key_t), heavy_load_desc);
+    memset(plan->slot, 0, sizeof(uint32_t) << plan->slot_bits);
+    for (uint32_t i = 0; i < plan->heavy_num; i++) {
+        uint32_t h = hash_key(plan->heavy[i].key, plan->slot_bits);
+        while (plan->slot[h] != 0)
+            h = (h + 1) & ((1u << plan->slot_bits) - 1);
+        plan->slot[h] = i + 1;
+    }
+
+    uint64_t *load = calloc(par_num, sizeof(uint64_t));
+    uint32_t *taken = calloc(par_num, sizeof(uint32_t));
+    plan->piece_par = malloc((plan->heavy_num * par_num + 1) * sizeof(uint32_t));
+    assert(load != NULL && taken != NULL && plan->piece_par != NULL);
+
+    uint64_t target = ((uint64_t)num_r + num_s + par_num - 1) / par_num;
+    uint32_t piece = 0;
+    for (uint32_t i = 0; i < plan->heavy_num; i++) {
+        heavy_key_t *h = &plan->heavy[i];
+        // as many pieces as partitions the key fills, only the s side of a piece shrinks
+        uint64_t k = ((uint64_t)h->r_num + h->s_num + target - 1) / target;
+        h->piece = piece;
+        h->piece_num = k < 1 ? 1 : k > par_num ? par_num : (uint32_t)k;
+        for (uint32_t j = 0; j < h->piece_num; j++) {
+            uint32_t p = least_loaded(load, par_num, taken, i + 1);
+            taken[p] = i + 1;
+            load[p] += h->r_num + h->s_num / h->piece_num;
+            plan->piece_par[piece++] = p;
+        }
+    }
+
+    bucket_size_t *order = malloc(fine_num * sizeof(bucket_size_t));
+    plan->bucket_par = malloc(fine_num * sizeof(uint32_t));
+    assert(order != NULL && plan->bucket_par != NULL);
+    for (uint32_t b = 0; b < fine_num; b++)
+        order[b] = (bucket_size_t){.num = bucket_num[b], .bucket = b};
+    qsort(order, fine_num, sizeof(bucket_size_t), bucket_size_desc);
+    for (uint32_t b = 0; b < fine_num; b++) {
+        uint32_t p = least_loaded(load, par_num, NULL, 0);
+        load[p] += order[b].num;
+        plan->bucket_par[order[b].bucket] = p;
+    }
+
+    free(order);
+    free(load);
+    free(taken);
+    free(bucket_num);
+}
+
+void destroy_skew_plan(skew_plan_t *plan) {
+    free(plan->bucket_par);
+    free(plan->heavy);
+    free(plan->slot);
+    free(plan->piece_par);
+}
+
+// partition a by plan, heavy keys are copied into all their partitions when
+// replicate, dealt round robin otherwise. returns the partitions, partition p
+// is [begin[p], begin[p + 1])
+tuple_t *partition_skew(const tuple_t *a, uint32_t size, const skew_plan_t *plan, bool replicate, uint32_t *begin) {
+    uint32_t par_num = 1u << plan->bits;
+    uint32_t fine_mask = (1u << (plan->bits + SKEW_FINE_BITS)) - 1;
+    uint32_t *offset = calloc(par_num, sizeof(uint32_t));
+    uint32_t *deal = calloc(plan->heavy_num + 1, sizeof(uint32_t));
+    swwc_line_t *line = aligned_alloc(64, par_num * sizeof(swwc_line_t));
+    assert(offset != NULL && deal != NULL && line != NULL);
+
+    for (uint32_t i = 0; i < size; i++) {
+        const heavy_key_t *h = find_heavy(plan, a[i].key);
+        if (h == NULL)
+            offset[plan->bucket_par[a[i].key & fine_mask]]++;
+        else if (replicate) {
+            for (uint32_t j = 0; j < h->piece_num; j++)
+                offset[plan->piece_par[h->piece + j]]++;
+        }
+        else
+            offset[plan->piece_par[h->piece + deal[h - plan->heavy]++ % h->piece_num]]++;
     }
 
+    uint32_t sum = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        uint32_t n = offset[p];
+        begin[p] = offset[p] = sum;
+        sum += n;
+    }
+    begin[par_num] = sum;
+
+    tuple_t *par = malloc(sum * sizeof(tuple_t));
+    assert(par != NULL);
+    memset(deal, 0, (plan->heavy_num + 1) * sizeof(uint32_t));
     for (uint32_t i = 0; i < size; i++) {
-        uint32_t par_id = a[i].key % par_num;
-        par[offset[par_id]] = a[i];
-        offset[par_id]++;
-        //assert(offset[par_id] % par_size != 0);
+        const heavy_key_t *h = find_heavy(plan, a[i].key);
+        if (h == NULL) {
+            uint32_t p = plan->bucket_par[a[i].key & fine_mask];
+            swwc_put(par, line, p, offset[p]++, begin, a[i]);
+        }
+        else if (replicate) {
+            for (uint32_t j = 0; j < h->piece_num; j++) {
+                uint32_t p = plan->piece_par[h->piece + j];
+                swwc_put(par, line, p, offset[p]++, begin, a[i]);
+            }
+        }
+        else {
+            uint32_t p = plan->piece_par[h->piece + deal[h - plan->heavy]++ % h->piece_num];
+            swwc_put(par, line, p, offset[p]++, begin, a[i]);
+        }
     }
+    swwc_flush(par, line, par_num, offset, begin);
+
+    free(offset);
+    free(deal);
+    free(line);
+    return par;
+}
+
+// largest partition over the average, r and s of a partition are one unit of work
+double partition_imbalance(const uint32_t *begin_r, const uint32_t *begin_s, uint32_t par_num) {
+    uint32_t largest = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        uint32_t n = begin_r[p + 1] - begin_r[p] + begin_s[p + 1] - begin_s[p];
+        largest = n > largest ? n : largest;
+    }
+    double average = (double)(begin_r[par_num] + begin_s[par_num]) / par_num;
+    return average > 0 ? largest / average : 1;
+}
+
+/*
+ * join planner: sort-merge whenever the caller wants sorted output, otherwise
+ * whichever is cheaper on this machine. a merge sort reads every tuple log2(n)
+ * times, the hash join builds or probes every tuple once but at random, and a
+ * probe walks every r tuple of its key, so duplicate keys cost the hash join
+ * one step per r x s pair while the merge join counts a key group at once.
+ * the rates are measured by calibrate_join() on a partition pair of the size
+ * to be joined, the pairs are estimated from a sample of both relations.
+ */
+
+#define JOIN_SORT_MERGE 0
+#define JOIN_HASH       1
+#define JOIN_AUTO       2
+
+const char *join_name[] = {"merge", "hash", "auto"};
+
+typedef struct {
+    double sort_ns;  // per tuple and merge level, the merge join included
+    double hash_ns;  // per build or probe tuple
+    double pair_ns;  // per r x s pair a probe walks
+} join_cost_t;
+
+static uint32_t log2_ceil(uint32_t n) {
+    uint32_t l = 0;
+    while (l < 32 && (1ull << l) < n)
+        l++;
+    return l;
+}
+
+// pairs is the expected join result of num_r and num_s
+int plan_join(uint32_t num_r, uint32_t num_s, uint64_t pairs, bool sorted_output, const join_cost_t *cost) {
+    if (sorted_output)
+        return JOIN_SORT_MERGE;
+
+    double sort_cost = ((double)num_r * log2_ceil(num_r) + (double)num_s * log2_ceil(num_s)) * cost->sort_ns;
+    double hash_cost = ((double)num_r + num_s) * cost->hash_ns + (double)pairs * cost->pair_ns;
+
+    return hash_cost < sort_cost ? JOIN_HASH : JOIN_SORT_MERGE;
 }
 
 #if 1 // change dataset
@@ -183,6 +922,43 @@ bool is_tuples_sorted(tuple_t *a, uint32_t size) {
 
 #endif
 
+// keys 0 .. size - 1 drawn with zipf(theta), key 0 is the most frequent
+void generate_zipf(tuple_t *a, uint32_t size, double theta) {
+    double *cdf = malloc(size * sizeof(double));
+    assert(cdf != NULL);
+
+    double sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        sum += 1.0 / pow(i + 1, theta);
+        cdf[i] = sum;
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        double u = (double)rand() / RAND_MAX * sum;
+        uint32_t lo = 0, hi = size - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        a[i].key = lo;
+        a[i].value = i;
+    }
+
+    free(cdf);
+}
+
+bool is_tuples_ordered(tuple_t *a, uint32_t size) {
+    for (uint32_t i = 1; i < size; i++) {
+        if (a[i - 1].key > a[i].key)
+            return false;
+    }
+
+    return true;
+}
+
 #if 1
 
 void print_tuples(tuple_t *a, uint32_t size) {
@@ -209,22 +985,431 @@ void print_tuples(tuple_t *a, uint32_t size) {
 
 #endif
 
+static inline unsigned long long my_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_nsec + (unsigned long long)t.tv_sec * 1000000000ULL;
+}
+
+// sort and join one partition pair, tmp holds the larger side, table is for the hash join
+uint64_t join_partition(tuple_t *r, tuple_t *s, uint32_t num_r, uint32_t num_s, int join, tuple_t *tmp,
+                        uint32_t *table) {
+    if (join == JOIN_HASH)
+        return hash_join(r, s, num_r, num_s, table);
+
+    merge_sort(r, num_r, tmp);
+    merge_sort(s, num_s, tmp);
+    return merge_join(r, s, num_r, num_s, tmp);
+}
+
+#define CALIBRATE_DUP   16          // r tuples per key when timing the probe walk
+#define JOIN_SAMPLE_NUM (64 * 1024) // tuples per relation to estimate the pairs
+
+// time both joins on random partition pairs of num tuples per side, once with
+// unique keys and once with CALIBRATE_DUP r tuples per key for the probe walk
+void calibrate_join(uint32_t num, join_cost_t *cost) {
+    if (num < CALIBRATE_DUP * 2)
+        num = CALIBRATE_DUP * 2;
+
+    tuple_t *r = malloc(num * sizeof(tuple_t) * 3);
+    uint32_t *table = malloc(sizeof(uint32_t) << hash_table_bits(num));
+    assert(r != NULL && table != NULL);
+    tuple_t *s = &r[num], *tmp = &r[num * 2];
+
+    generate_dataset(r, num);
+    generate_dataset(s, num);
+    unsigned long long t = my_clock();
+    uint64_t matches = hash_join(r, s, num, num, table);
+    cost->hash_ns = (double)(my_clock() - t) / (2.0 * num);
+
+    t = my_clock();
+    matches -= join_partition(r, s, num, num, JOIN_SORT_MERGE, tmp, NULL);
+    cost->sort_ns = (double)(my_clock() - t) / (2.0 * num * log2_ceil(num));
+    assert(matches == 0);
+
+    // num / CALIBRATE_DUP keys of s meet CALIBRATE_DUP r tuples each
+    shuffle_tuples(s, num);
+    for (uint32_t i = 0; i < num; i++)
+        r[i].key = i % (num / CALIBRATE_DUP);
+    shuffle_tuples(r, num);
+    t = my_clock();
+    matches = hash_join(r, s, num, num, table);
+    double walk = (double)(my_clock() - t) - cost->hash_ns * 2.0 * num;
+    cost->pair_ns = walk > 0 ? walk / matches : 0;
+
+    free(r);
+    free(table);
+}
+
+// join result of r and s scaled up from the join of a random sample of both
+uint64_t estimate_join_pairs(const tuple_t *r, uint32_t num_r, const tuple_t *s, uint32_t num_s) {
+    uint32_t m_r = num_r < JOIN_SAMPLE_NUM ? num_r : JOIN_SAMPLE_NUM;
+    uint32_t m_s = num_s < JOIN_SAMPLE_NUM ? num_s : JOIN_SAMPLE_NUM;
+    if (m_r == 0 || m_s == 0)
+        return 0;
+
+    tuple_t *sample = malloc(((size_t)m_r + m_s) * sizeof(tuple_t) * 2);
+    assert(sample != NULL);
+    tuple_t *sr = sample, *ss = &sample[m_r], *tmp = &sample[m_r + m_s];
+
+    for (uint32_t i = 0; i < m_r; i++)
+        sr[i] = r[m_r == num_r ? i : (uint32_t)rand() % num_r];
+    for (uint32_t i = 0; i < m_s; i++)
+        ss[i] = s[m_s == num_s ? i : (uint32_t)rand() % num_s];
+    uint64_t pairs = join_partition(sr, ss, m_r, m_s, JOIN_SORT_MERGE, tmp, NULL);
+
+    free(sample);
+    return (uint64_t)((double)pairs * ((double)num_r / m_r) * ((double)num_s / m_s));
+}
+
+/*
+ * work-stealing partition scheduler
+ *
+ * every partition pair is one task: sort r, sort s and join, or build and
+ * probe the hash table. the tasks are dealt largest first and round robin to
+ * one deque per worker, the owner takes its largest task from the bottom and
+ * an idle worker steals the smallest one from the top of another deque. so
+ * the large partitions start early and the small ones fill the gaps. every
+ * worker has its own sort scratch and hash table, the matches are counted per
+ * partition and added up once all workers are done.
+ */
+
+typedef struct {
+    uint32_t *task;
+    uint32_t top;     // next task to steal
+    uint32_t bottom;  // one past the next task of the owner
+    pthread_mutex_t lock;
+} task_deque_t;
+
+typedef struct {
+    tuple_t *par_r;
+    tuple_t *par_s;
+    const uint32_t *begin_r;
+    const uint32_t *begin_s;
+    int join;
+    uint64_t *matches;     // per partition
+    task_deque_t *deque;   // per worker
+    uint32_t worker_num;
+    uint32_t scratch_num;  // tuples of the largest partition side
+    uint32_t table_bits;
+    pthread_barrier_t barrier;
+} join_sched_t;
+
+typedef struct {
+    join_sched_t *sched;
+    uint32_t id;
+    uint32_t tasks;
+    uint32_t stolen;
+    unsigned long long start;
+    unsigned long long busy;
+    unsigned long long end;
+    pthread_t thread;
+} join_worker_t;
+
+static bool deque_pop(task_deque_t *d, uint32_t *task) {
+    pthread_mutex_lock(&d->lock);
+    bool found = d->top < d->bottom;
+    if (found)
+        *task = d->task[--d->bottom];
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool deque_steal(task_deque_t *d, uint32_t *task) {
+    pthread_mutex_lock(&d->lock);
+    bool found = d->top < d->bottom;
+    if (found)
+        *task = d->task[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+void *join_worker(void *arg) {
+    join_worker_t *w = arg;
+    join_sched_t *sched = w->sched;
+    tuple_t *tmp = malloc(sched->scratch_num * sizeof(tuple_t));
+    uint32_t *table = sched->join == JOIN_HASH ? malloc(sizeof(uint32_t) << sched->table_bits) : NULL;
+    assert(tmp != NULL && (sched->join != JOIN_HASH || table != NULL));
+
+    pthread_barrier_wait(&sched->barrier);
+    w->start = my_clock();
+    for (;;) {
+        uint32_t task;
+        bool found = deque_pop(&sched->deque[w->id], &task);
+        for (uint32_t i = 1; !found && i < sched->worker_num; i++) {
+            found = deque_steal(&sched->deque[(w->id + i) % sched->worker_num], &task);
+            w->stolen += found;
+        }
+        if (!found) // no task is added later, every deque is empty
+            break;
+
+        unsigned long long t = my_clock();
+        uint32_t b_r = sched->begin_r[task], b_s = sched->begin_s[task];
+        sched->matches[task] = join_partition(&sched->par_r[b_r], &sched->par_s[b_s],
+                                              sched->begin_r[task + 1] - b_r, sched->begin_s[task + 1] - b_s,
+                                              sched->join, tmp, table);
+        w->busy += my_clock() - t;
+        w->tasks++;
+    }
+    w->end = my_clock();
+
+    free(tmp);
+    free(table);
+    return NULL;
+}
+
+static int partition_size_desc(const void *x, const void *y) {
+    // size in the high half, partition in the low half
+    uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+    return (a < b) - (a > b);
+}
+
+uint64_t join_partitions_parallel(tuple_t *par_r, tuple_t *par_s, const uint32_t *begin_r, const uint32_t *begin_s,
+                                  uint32_t par_num, int join, uint32_t worker_num) {
+    join_sched_t sched = {.par_r = par_r, .par_s = par_s, .begin_r = begin_r, .begin_s = begin_s, .join = join,
+                          .worker_num = worker_num};
+    uint64_t *order = malloc(par_num * sizeof(uint64_t));
+    uint32_t *task = malloc(par_num * sizeof(uint32_t));
+    sched.matches = malloc(par_num * sizeof(uint64_t));
+    sched.deque = malloc(worker_num * sizeof(task_deque_t));
+    assert(order != NULL && task != NULL && sched.matches != NULL && sched.deque != NULL);
+
+    uint32_t max_r = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        uint32_t nr = begin_r[p + 1] - begin_r[p], ns = begin_s[p + 1] - begin_s[p];
+        max_r = nr > max_r ? nr : max_r;
+        sched.scratch_num = nr > sched.scratch_num ? nr : sched.scratch_num;
+        sched.scratch_num = ns > sched.scratch_num ? ns : sched.scratch_num;
+        order[p] = (uint64_t)(nr + ns) << 32 | p;
+    }
+    sched.table_bits = hash_table_bits(max_r);
+    qsort(order, par_num, sizeof(uint64_t), partition_size_desc);
+
+    // worker w gets the tasks w, w + worker_num, ... of the order, its largest task at the bottom
+    uint32_t *next = task;
+    for (uint32_t w = 0; w < worker_num; w++) {
+        task_deque_t *d = &sched.deque[w];
+        d->task = next;
+        d->top = 0;
+        d->bottom = 0;
+        for (uint32_t i = w; i < par_num; i += worker_num)
+            d->bottom++;
+        for (uint32_t i = w, j = d->bottom; i < par_num; i += worker_num)
+            d->task[--j] = (uint32_t)order[i];
+        next += d->bottom;
+        pthread_mutex_init(&d->lock, NULL);
+    }
+
+    pthread_barrier_init(&sched.barrier, NULL, worker_num);
+    join_worker_t workers[worker_num];
+    for (uint32_t i = 0; i < worker_num; i++) {
+        workers[i] = (join_worker_t){.sched = &sched, .id = i};
+        int ret = pthread_create(&workers[i].thread, NULL, join_worker, &workers[i]);
+        assert(ret == 0);
+    }
+
+    unsigned long long finish = 0;
+    for (uint32_t i = 0; i < worker_num; i++) {
+        pthread_join(workers[i].thread, NULL);
+        finish = workers[i].end > finish ? workers[i].end : finish;
+    }
+
+    // idle: stealing, and waiting for the last worker once the deques are empty
+    for (uint32_t i = 0; i < worker_num; i++) {
+        join_worker_t *w = &workers[i];
+        printf("worker: %u, tasks: %u, stolen: %u, busy: %f ms, idle: %f ms\n", i, w->tasks, w->stolen,
+               (float)w->busy / 1000000, (float)(finish - w->start - w->busy) / 1000000);
+    }
+
+    uint64_t matches = 0;
+    for (uint32_t p = 0; p < par_num; p++)
+        matches += sched.matches[p];
+
+    for (uint32_t w = 0; w < worker_num; w++)
+        pthread_mutex_destroy(&sched.deque[w].lock);
+    pthread_barrier_destroy(&sched.barrier);
+    free(order);
+    free(task);
+    free(sched.matches);
+    free(sched.deque);
+    return matches;
+}
+
 #define PAR_SIZE             ((uint32_t)((20 << 20) / 16))  // 20MB/16
 #define TUPLES_NUM_PER_PAR   ((uint32_t)(((PAR_SIZE) / sizeof(tuple_t))))
 
+// kernels specialized for wider layouts, see tuple_template.h
+
+#define TUPLE_SUFFIX  44
+#define TUPLE_KEY_T   uint32_t
+#define TUPLE_VALUE_T uint32_t
+#include "tuple_template.h"
+
+#define TUPLE_SUFFIX  88
+#define TUPLE_KEY_T   uint64_t
+#define TUPLE_VALUE_T uint64_t
+#include "tuple_template.h"
+
+#define TUPLE_SUFFIX  816
+#define TUPLE_KEY_T   uint64_t
+#define TUPLE_VALUE_T tuple_payload16_t
+#include "tuple_template.h"
+
+#define RUN_LAYOUT(s, size) do {                                                        \
+        uint32_t par_size = PAR_SIZE / sizeof(tuple_##s##_t);                           \
+        uint32_t par_num = (size) / par_size;                                           \
+        assert(par_num > 0 && (size) % par_size == 0);                                  \
+        tuple_##s##_t *r = malloc((size) * sizeof(tuple_##s##_t));                     \
+        tuple_##s##_t *q = malloc((size) * sizeof(tuple_##s##_t));                     \
+        tuple_##s##_t *par = malloc((size) * sizeof(tuple_##s##_t) * 2);               \
+        tuple_##s##_t *tmp = malloc(par_size * sizeof(tuple_##s##_t));                 \
+        assert(r != NULL && q != NULL && par != NULL && tmp != NULL);                   \
+        generate_tuples_##s(r, size);                                                   \
+        generate_tuples_##s(q, size);                                                   \
+        clock_t t = clock();                                                            \
+        uint64_t matches = partition_sort_join_##s(r, q, size, par, par_num, par_size, tmp); \
+        t = clock() - t;                                                                \
+        printf("layout: %s, tuple size: %zu, par_num: %u, time: %f ms, matches: %lu\n", \
+               #s, sizeof(tuple_##s##_t), par_num, (float)t * 1000 / CLOCKS_PER_SEC,   \
+               (unsigned long)matches);                                                \
+        free(r);                                                                        \
+        free(q);                                                                        \
+        free(par);                                                                      \
+        free(tmp);                                                                      \
+    } while (0)
+
+bool run_layout(const char *layout, uint32_t size) {
+    if (strcmp(layout, "44") == 0)
+        RUN_LAYOUT(44, size);
+    else if (strcmp(layout, "88") == 0)
+        RUN_LAYOUT(88, size);
+    else if (strcmp(layout, "816") == 0)
+        RUN_LAYOUT(816, size);
+    else
+        return false;
+
+    return true;
+}
+
+void usage(const char *exec_name) {
+    printf("usage: %s [-l layout] [-j join] [-o] [-s] [-k] [-z theta] [-m] [-H] [-t thread_num] [-w worker_num] tuples_size\n"
+           "\t-l \tpartition, sort and join the specialized key+value layout: 44, 88, 816\n"
+           "\t-j \tjoin of every partition pair: merge, hash, auto picks from measured costs (default: auto)\n"
+           "\t-o \tsorted output is requested, auto picks merge\n"
+           "\t-s \trange partition on sampled splitters, the sorted partitions concatenate into one order\n"
+           "\t-k \tskew-aware radix partitioning, heavy keys are split over several partitions\n"
+           "\t-z \tzipf distributed keys with the given theta, e.g. 0.99\n"
+           "\t-m \tmulti-level radix partitioning into l2 sized partitions, fanout per pass from l1d and dtlb\n"
+           "\t-H \tpartition buffers on huge pages\n"
+           "\t-t \tnumber of partitioning threads (default: 1)\n"
+           "\t-w \tnumber of work-stealing workers that sort and join the partitions (default: 1)\n",
+           exec_name);
+}
+
+int parse_join(const char *name) {
+    for (int i = 0; i <= JOIN_AUTO; i++) {
+        if (strcmp(name, join_name[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("usage: %s tuples_size", argv[0]);
+    const char *layout = NULL;
+    int join = JOIN_AUTO;
+    bool sorted_output = false;
+    bool range = false;
+    bool skew = false;
+    double theta = 0;
+    uint32_t thread_num = 1;
+    uint32_t worker_num = 1;
+    bool multi_level = false;
+    bool huge = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:j:oskz:mHt:w:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            layout = optarg;
+            break;
+        case 'j':
+            join = parse_join(optarg);
+            if (join < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            sorted_output = true;
+            break;
+        case 's':
+            range = true;
+            break;
+        case 'k':
+            skew = true;
+            break;
+        case 'z':
+            theta = atof(optarg);
+            assert(theta > 0);
+            break;
+        case 'm':
+            multi_level = true;
+            break;
+        case 'H':
+            huge = true;
+            break;
+        case 't':
+            thread_num = (uint32_t)atoi(optarg);
+            assert(thread_num > 0);
+            break;
+        case 'w':
+            worker_num = (uint32_t)atoi(optarg);
+            assert(worker_num > 0);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return -1;
     }
 
-    int size = atoi(argv[1]);
+    int size = atoi(argv[optind]);
     assert(size > 0);
+    assert(!(range && skew)); // split heavy keys break the key ranges
+    assert(!(multi_level && (range || skew)));
 
-    uint32_t par_num = size / TUPLES_NUM_PER_PAR;
+    if (layout != NULL) {
+        srand(time(NULL));
+        if (!run_layout(layout, size)) {
+            usage(argv[0]);
+            return -1;
+        }
+        return 0;
+    }
+
+    // power of two partitions of at most TUPLES_NUM_PER_PAR tuples on average,
+    // or of l2 size in passes of a bounded fanout
+    uint32_t par_bits = 0, pass_bits = 0;
+    if (multi_level) {
+        uint32_t l1d = detect_cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+        uint32_t l2 = detect_cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+        par_bits = l2_partition_bits(size, l2);
+        pass_bits = pass_fanout_bits(l1d, huge);
+        printf("l1d: %u KB, l2: %u KB, dtlb: %u, huge pages: %d, fanout per pass: %u\n", l1d >> 10, l2 >> 10,
+               DTLB_ENTRIES, huge, 1u << pass_bits);
+    }
+    else {
+        while (((uint32_t)size >> par_bits) > TUPLES_NUM_PER_PAR)
+            par_bits++;
+    }
+    uint32_t par_num = 1u << par_bits;
     printf("tuples size: %d, tuples memory: %f MB, par_num: %u, tuples_num_per_par: %u\n",
            size, (float)size * sizeof(tuple_t) / 1024 / 1024, par_num, TUPLES_NUM_PER_PAR);
-    assert(size % TUPLES_NUM_PER_PAR == 0);
 
     srand(time(NULL));
 
@@ -235,40 +1420,138 @@ int main(int argc, char *argv[]) {
     assert(b != NULL);
 
 
-    generate_dataset(a, size);
-    generate_dataset(b, size);
+    if (theta > 0) {
+        generate_zipf(a, size, theta);
+        generate_zipf(b, size, theta);
+    }
+    else {
+        generate_dataset(a, size);
+        generate_dataset(b, size);
+    }
     print_tuples(a, size);
 
-    tuple_t *tmp = malloc(size * sizeof(tuple_t));
-    assert(tmp != NULL);
+    tuple_t *tmp = alloc_partition_buffer(size * sizeof(tuple_t), huge);
     memset(tmp, 0, size * sizeof(tuple_t));
 
-    tuple_t *par = malloc(size * sizeof(tuple_t) * 2);
-    assert(par != NULL);
+    uint32_t *begin_r = malloc((par_num + 1) * sizeof(uint32_t));
+    uint32_t *begin_s = malloc((par_num + 1) * sizeof(uint32_t));
+    assert(begin_r != NULL && begin_s != NULL);
 
-    partition_tuples(a, size, par, par_num, 0, TUPLES_NUM_PER_PAR * 2);
-    partition_tuples(b, size, par, par_num, TUPLES_NUM_PER_PAR, TUPLES_NUM_PER_PAR * 2);
+    // r partitions first, then s partitions. the skew-aware partitions are
+    // allocated once their size is known, heavy r tuples are replicated
+    tuple_t *par = NULL, *par_r, *par_s;
+    skew_plan_t plan;
+    if (skew) {
+        // imbalance of the plain radix partitions
+        memset(begin_r, 0, (par_num + 1) * sizeof(uint32_t));
+        memset(begin_s, 0, (par_num + 1) * sizeof(uint32_t));
+        partition_histogram(a, size, 0, par_num - 1, &begin_r[1]);
+        partition_histogram(b, size, 0, par_num - 1, &begin_s[1]);
+        for (uint32_t i = 0; i < par_num; i++) {
+            begin_r[i + 1] += begin_r[i];
+            begin_s[i + 1] += begin_s[i];
+        }
+        printf("radix partition imbalance (largest / average): %.2f\n", partition_imbalance(begin_r, begin_s, par_num));
+    }
+    else {
+        par = alloc_partition_buffer(size * sizeof(tuple_t) * 2, huge);
+        par_r = par;
+        par_s = &par[size];
+    }
 
-    uint32_t matches = 0;
+    // both relations use the splitters of a, so partition i of r and s cover the same keys
+    tuple_key_t *tree = malloc(par_num * sizeof(tuple_key_t));
+    assert(tree != NULL);
 
-    printf("begin merge sort and merge join\n");
+    unsigned long long pt = my_clock();
+    if (skew) {
+        plan_skew(a, size, b, size, par_bits, &plan);
+        par_r = partition_skew(a, size, &plan, true, begin_r);
+        par_s = partition_skew(b, size, &plan, false, begin_s);
+    }
+    else if (multi_level) {
+        // tmp is free until the join
+        uint32_t passes = partition_multi_level(a, size, par_r, tmp, par_bits, pass_bits, begin_r);
+        partition_multi_level(b, size, par_s, tmp, par_bits, pass_bits, begin_s);
+        printf("multi-level partitioning: %u passes\n", passes);
+    }
+    else if (range) {
+        sample_splitters(a, size, par_bits, tree);
+        partition_range_parallel(a, size, par_r, par_bits, tree, begin_r, thread_num);
+        partition_range_parallel(b, size, par_s, par_bits, tree, begin_s, thread_num);
+    }
+    else {
+        partition_radix_parallel(a, size, par_r, par_bits, begin_r, thread_num);
+        partition_radix_parallel(b, size, par_s, par_bits, begin_s, thread_num);
+    }
+    pt = my_clock() - pt;
 
-    clock_t t = clock();
+    uint32_t max_r = 0, max_s = 0, min_par = UINT32_MAX;
     for (uint32_t i = 0; i < par_num; i++) {
-        uint32_t off = TUPLES_NUM_PER_PAR * i * 2;
-        merge_sort(&par[off], TUPLES_NUM_PER_PAR, tmp);
-        merge_sort(&par[off + TUPLES_NUM_PER_PAR], TUPLES_NUM_PER_PAR, tmp);
-        matches += merge_join(&par[off], &par[off + TUPLES_NUM_PER_PAR], TUPLES_NUM_PER_PAR, TUPLES_NUM_PER_PAR, tmp);
+        uint32_t nr = begin_r[i + 1] - begin_r[i], ns = begin_s[i + 1] - begin_s[i];
+        max_r = nr > max_r ? nr : max_r;
+        max_s = ns > max_s ? ns : max_s;
+        min_par = nr < min_par ? nr : min_par;
+        min_par = ns < min_par ? ns : min_par;
+    }
+    printf("partition: %s, threads: %u, time: %f ms, smallest: %u, largest: %u\n",
+           skew ? "skew" : range ? "range" : multi_level ? "multi-level" : "radix", thread_num, (float)pt / 1000000, min_par,
+           max_r > max_s ? max_r : max_s);
+    if (skew) {
+        printf("skew partition imbalance (largest / average): %.2f, heavy keys: %u, replicated r tuples: %u\n",
+               partition_imbalance(begin_r, begin_s, par_num), plan.heavy_num, begin_r[par_num] - size);
+        destroy_skew_plan(&plan);
+    }
+    assert(max_r <= (uint32_t)size && max_s <= (uint32_t)size); // tmp holds the largest partition
+
+    uint64_t matches = 0;
+
+    if (join == JOIN_AUTO) {
+        join_cost_t cost;
+        calibrate_join(size / par_num, &cost);
+        uint64_t pairs = estimate_join_pairs(a, size, b, size);
+        join = plan_join(size / par_num, size / par_num, pairs / par_num, sorted_output, &cost);
+        printf("join cost: merge level %f ns, hash %f ns per tuple, probe walk %f ns per pair, estimated pairs: %lu\n",
+               cost.sort_ns, cost.hash_ns, cost.pair_ns, (unsigned long)pairs);
     }
+    assert(!(sorted_output && join == JOIN_HASH));
 
-    t = clock() - t;
-    printf("time: %f ms, matches: %u\n", (float)t * 1000 / CLOCKS_PER_SEC, matches);
+    printf("begin %s join\n", join_name[join]);
 
-    print_tuples(par, size);
+    unsigned long long t = my_clock();
+    if (worker_num > 1) {
+        matches = join_partitions_parallel(par_r, par_s, begin_r, begin_s, par_num, join, worker_num);
+    }
+    else {
+        // one table for every partition, reused
+        uint32_t *table = NULL;
+        if (join == JOIN_HASH) {
+            table = malloc(sizeof(uint32_t) << hash_table_bits(max_r));
+            assert(table != NULL);
+        }
+
+        for (uint32_t i = 0; i < par_num; i++) {
+            uint32_t nr = begin_r[i + 1] - begin_r[i], ns = begin_s[i + 1] - begin_s[i];
+            matches += join_partition(&par_r[begin_r[i]], &par_s[begin_s[i]], nr, ns, join, tmp, table);
+        }
+        free(table);
+    }
+
+    t = my_clock() - t;
+    printf("join: %s, workers: %u, time: %f ms, matches: %lu\n", join_name[join], worker_num, (float)t / 1000000,
+           (unsigned long)matches);
+    free(tree);
+
+    print_tuples(par_r, begin_r[par_num]);
+    if (range && join == JOIN_SORT_MERGE) {
+        // distribution sort: the sorted range partitions are one sorted relation
+        assert(theta > 0 ? is_tuples_ordered(par_r, size) : is_tuples_sorted(par_r, size));
+        assert(theta > 0 ? is_tuples_ordered(par_s, size) : is_tuples_sorted(par_s, size));
+        printf("range partitions concatenate into sorted r and s\n");
+    }
 //    for (uint32_t i = 0; i < par_num; i++) {
-//        uint32_t off = TUPLES_NUM_PER_PAR * i * 2;
-//        assert(is_tuples_sorted(&par[off], TUPLES_NUM_PER_PAR));
-//        assert(is_tuples_sorted(&par[off + TUPLES_NUM_PER_PAR], TUPLES_NUM_PER_PAR));
+//        assert(is_tuples_sorted(&par_r[begin_r[i]], begin_r[i + 1] - begin_r[i]));
+//        assert(is_tuples_sorted(&par_s[begin_s[i]], begin_s[i + 1] - begin_s[i]));
 //    }
 
     return 0;
@@ -12,18 +12,54 @@
 
 #include <stdint.h>
 
+/*
+ * tuple layout as key+value bytes, chosen at compile time with
+ * -DTUPLE_LAYOUT=44, 88 or 816 (make TUPLE_LAYOUT=...)
+ */
+#ifndef TUPLE_LAYOUT
+#define TUPLE_LAYOUT 44
+#endif
+
+#if TUPLE_LAYOUT == 44
 typedef uint32_t tuple_key_t;
 typedef uint32_t tuple_value_t;
+#define TUPLE_SIZE 8
+#elif TUPLE_LAYOUT == 88
+typedef uint64_t tuple_key_t;
+typedef uint64_t tuple_value_t;
+#define TUPLE_SIZE 16
+#elif TUPLE_LAYOUT == 816
+typedef uint64_t tuple_key_t;
+typedef struct {
+	uint64_t lo;
+	uint64_t hi;
+} tuple_value_t;
+#define TUPLE_SIZE 24
+#else
+#error "TUPLE_LAYOUT must be 44, 88 or 816"
+#endif
 
 typedef struct  {
 	tuple_key_t   key;
 	tuple_value_t value;
 } tuple_t;
 
+// TUPLE_SIZE is sizeof(tuple_t) in a form the preprocessor can check
+_Static_assert(sizeof(tuple_t) == TUPLE_SIZE, "TUPLE_SIZE does not match tuple_t");
+
+/*
+ * every size derives from the tuples of one tasklet, so the tasklets
+ * split TUPLES_NUM evenly whatever the tuple size
+ */
 #define MRAM_SIZE (20 << 20) // 20MB
-#define TUPLES_NUM (((MRAM_SIZE) / sizeof(tuple_t))) // one tuples
-#define TUPLES_NUM_PER_TASKLET ((TUPLES_NUM - 1 + NR_TASKLETS) / NR_TASKLETS)
-#define MRAM_SIZE_PER_TASKLET  ((MRAM_SIZE - 1 + NR_TASKLETS) / NR_TASKLETS)
+#define TUPLES_NUM_PER_TASKLET (MRAM_SIZE / NR_TASKLETS / TUPLE_SIZE)
+#define TUPLES_NUM (TUPLES_NUM_PER_TASKLET * NR_TASKLETS) // one relation
+#define MRAM_SIZE_PER_TASKLET (TUPLES_NUM_PER_TASKLET * TUPLE_SIZE)
+
+// MRAM DMA needs 8 byte aligned offsets
+#if MRAM_SIZE_PER_TASKLET % 8 != 0
+#error "MRAM_SIZE_PER_TASKLET must be a multiple of 8 bytes"
+#endif
 
 
 /**
@@ -16,7 +16,7 @@
 STDOUT_BUFFER_INIT(256);
 #endif
 
-#define WCACHE_SIZE 256 
+#define WCACHE_SIZE (2048 / sizeof(tuple_t)) // 2KB of tuples for every layout
 
 BARRIER_INIT(barrier, NR_TASKLETS);
 MUTEX_INIT(mutex_responses);
@@ -32,7 +32,7 @@ __dma_aligned tuple_t wcache[NR_TASKLETS][WCACHE_SIZE];
 uint32_t wcache_index[NR_TASKLETS] = {0};
 
 uintptr_t data_begin = (uintptr_t)DPU_MRAM_HEAP_POINTER;
-uintptr_t tmp_begin = (uintptr_t)DPU_MRAM_HEAP_POINTER + MRAM_SIZE + MRAM_SIZE;
+uintptr_t tmp_begin = (uintptr_t)DPU_MRAM_HEAP_POINTER + (TUPLES_NUM * sizeof(tuple_t) << 1);
 
 void flush_cache(uint8_t tid, __mram_ptr tuple_t *wmem, uint32_t *mram_index) {
     if (wcache_index[tid] == 0)
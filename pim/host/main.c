@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +41,7 @@ DPU_INCBIN(dpu_binary, DPU_BINARY)
 #define COLOR_NONE "\e[0m"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static inline unsigned long long my_clock(void)
 {
@@ -76,7 +78,7 @@ dpu_error_t load_and_copy_mram_file_into_dpus(struct dpu_set_t rank, uint32_t ra
     //    printf("dpu_id: %u, rank_id: %u, each_dpu: %u\n", dpu_id, rank_id, each_dpu);
         DPU_ASSERT(dpu_prepare_xfer(dpu, &ctx->par[dpu_id * TUPLES_NUM *2]));
     }
-    DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, MRAM_SIZE * 2, DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, TUPLES_NUM * sizeof(tuple_t) * 2, DPU_XFER_DEFAULT));
 
     printf("thread_id: %lu, load mram data finished. rank_id: %u, t: %llu ns\n", pthread_self(), rank_id, my_clock() - t);
     return DPU_OK;
@@ -165,7 +167,7 @@ dpu_error_t get_response_from_dpus(struct dpu_set_t rank, uint32_t rank_id, void
             uint32_t dpu_id = dpu_offset[rank_id] + each_dpu;
             DPU_ASSERT(dpu_prepare_xfer(dpu, &ctx->par[dpu_id * TUPLES_NUM *2]));
         }
-        DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, MRAM_SIZE * 2, DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_push_xfer(rank, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, TUPLES_NUM * sizeof(tuple_t) * 2, DPU_XFER_DEFAULT));
         printf("thread: %lu, rank: %u, send mram data. time: %llu ns, loop: %u\n", pthread_self(), rank_id, my_clock() - t, ctx->loop[rank_id]);
         t = my_clock();
     
@@ -195,17 +197,22 @@ dpu_error_t get_response_from_dpus(struct dpu_set_t rank, uint32_t rank_id, void
 
 #define DEFAULT_MRAM 1
 #define DEFAULT_LOOP 1
+#define DEFAULT_THREAD 1
 #define DEFAULT_MRAM_PATH "."
 
 __attribute__((noreturn)) static void usage(FILE *f, int exit_code, const char *exec_name)
 {
     /* clang-format off */
     fprintf(f,
-            "\nusage: %s [-p <mram_path>] [-m <number_of_mram>] [-l <number_of_loop>] [-n]\n"
+            "\nusage: %s [-p <mram_path>] [-m <number_of_mram>] [-l <number_of_loop>] [-t <number_of_thread>] [-s] [-k] [-z <theta>] [-n]\n"
             "\n"
             "\t-p \tthe path to the mram location (default: '" DEFAULT_MRAM_PATH "')\n"
             "\t-m \tthe number of mram to used (default: " STR(DEFAULT_MRAM) ")\n"
             "\t-l \tthe number of loop to run (default: " STR(DEFAULT_LOOP) ")\n"
+            "\t-t \tthe number of partitioning threads (default: " STR(DEFAULT_THREAD) ")\n"
+            "\t-s \trange partition on sampled splitters, the sorted partitions concatenate into one order\n"
+            "\t-k \tskew-aware partitioning, heavy keys are split over several partitions\n"
+            "\t-z \tzipf distributed keys with the given theta, e.g. 0.99, requires -k\n"
             "\t-n \tavoid loading the MRAM (to be used with caution)\n",
             exec_name);
     /* clang-format on */
@@ -220,11 +227,12 @@ static void verify_path_exists(const char *path)
     }
 }
 
-static void parse_args(int argc, char **argv, unsigned int *nb_mram, unsigned int *nb_loop, bool *load_mram, char **mram_path)
+static void parse_args(int argc, char **argv, unsigned int *nb_mram, unsigned int *nb_loop, unsigned int *nb_thread, bool *load_mram,
+    bool *range, bool *skew, double *theta, char **mram_path)
 {
     int opt;
     extern char *optarg;
-    while ((opt = getopt(argc, argv, "hm:l:np:")) != -1) {
+    while ((opt = getopt(argc, argv, "hm:l:t:skz:np:")) != -1) {
         switch (opt) {
         case 'p':
             *mram_path = strdup(optarg);
@@ -235,6 +243,22 @@ static void parse_args(int argc, char **argv, unsigned int *nb_mram, unsigned in
         case 'l':
             *nb_loop = (unsigned int)atoi(optarg);
             break;
+        case 't':
+            *nb_thread = (unsigned int)atoi(optarg);
+            if (*nb_thread == 0)
+                usage(stderr, EXIT_FAILURE, argv[0]);
+            break;
+        case 's':
+            *range = true;
+            break;
+        case 'k':
+            *skew = true;
+            break;
+        case 'z':
+            *theta = atof(optarg);
+            if (*theta <= 0)
+                usage(stderr, EXIT_FAILURE, argv[0]);
+            break;
         case 'n':
             *load_mram = false;
             break;
@@ -244,6 +268,14 @@ static void parse_args(int argc, char **argv, unsigned int *nb_mram, unsigned in
             usage(stderr, EXIT_FAILURE, argv[0]);
         }
     }
+    if (*range && *skew) {
+        // split heavy keys break the key ranges
+        usage(stderr, EXIT_FAILURE, argv[0]);
+    }
+    if (*theta > 0 && !*skew) {
+        // a hot key overflows its hash or range slot, only -k splits it
+        usage(stderr, EXIT_FAILURE, argv[0]);
+    }
     verify_path_exists(*mram_path);
 }
 
@@ -307,6 +339,36 @@ void generate_dataset1(tuple_t *a, uint32_t size) {
     shuffle_tuples(a, size);
 }
 
+// keys 1 .. size drawn with zipf(theta), key 1 is the most frequent
+void generate_zipf(tuple_t *a, uint32_t size, double theta)
+{
+    double *cdf = malloc(size * sizeof(double));
+    assert(cdf != NULL);
+
+    double sum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        sum += 1.0 / pow(i + 1, theta);
+        cdf[i] = sum;
+    }
+
+    memset(a, 0, size * sizeof(tuple_t));
+    for (uint32_t i = 0; i < size; i++) {
+        double u = (double)rand() / RAND_MAX * sum;
+        uint32_t lo = 0, hi = size - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        a[i].key = lo + 1;
+    }
+
+    free(cdf);
+}
+
 void partition_tuples(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num, uint32_t par_off, uint32_t par_size) {
     uint32_t offset[par_num];
     memset(offset, 0, sizeof(offset));
@@ -322,8 +384,546 @@ void partition_tuples(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num,
     }
 }
 
+/*
+ * range partitioning: the splitters come from a sorted random sample of r and
+ * partition p gets the keys in [splitter[p - 1], splitter[p]), so the sorted
+ * partitions of the dpus concatenate into one sorted relation. the splitters
+ * are an eytzinger tree (node 1 is the root, the children of node k are 2k
+ * and 2k + 1) padded with the largest key to a power of two, the search is
+ * one compare per level without a branch. partitions are not equal, so only
+ * 7/8 of every slot is filled with tuples and the rest is padded with a key
+ * that sorts last and never joins.
+ */
+
+#define RANGE_OVERSAMPLE 2048    // samples per partition
+#define RANGE_HEADROOM_SHIFT 3   // 1/8 of every slot is left for the larger partitions
+
+static int compare_keys(const void *a, const void *b)
+{
+    tuple_key_t x = *(const tuple_key_t *)a, y = *(const tuple_key_t *)b;
+    return (x > y) - (x < y);
+}
+
+// fill the subtree of node k in order from sorted[i] on, returns the next unused i
+static uint32_t eytzinger_fill(tuple_key_t *tree, uint32_t n, const tuple_key_t *sorted, uint32_t i, uint32_t k)
+{
+    if (k <= n) {
+        i = eytzinger_fill(tree, n, sorted, i, 2 * k);
+        tree[k] = sorted[i++];
+        i = eytzinger_fill(tree, n, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+// tree[1 .. 2^bits - 1] gets the par_num - 1 splitters of a sample of a, then the largest key
+void sample_splitters(const tuple_t *a, uint32_t size, uint32_t par_num, uint32_t bits, tuple_key_t *tree)
+{
+    uint32_t tree_num = 1u << bits;
+    uint32_t num = par_num * RANGE_OVERSAMPLE;
+    tuple_key_t *sample = malloc((num > tree_num ? num : tree_num) * sizeof(tuple_key_t));
+    assert(sample != NULL);
+
+    for (uint32_t i = 0; i < num; i++) {
+        sample[i] = a[rand() % size].key;
+    }
+    qsort(sample, num, sizeof(tuple_key_t), compare_keys);
+
+    // the splitters go to the front of sample, in place
+    for (uint32_t p = 1; p < tree_num; p++) {
+        sample[p - 1] = p < par_num ? sample[(uint64_t)p * num / par_num] : (tuple_key_t)-1;
+    }
+    eytzinger_fill(tree, tree_num - 1, sample, 0, 1);
+
+    free(sample);
+}
+
+/*
+ * skew-aware partitioning: with zipf keys a few hot keys fill one slot and
+ * its dpu finishes last. a sample of r and s finds the heavy keys, one pass
+ * measures the exact size of every heavy key and of every fine bucket
+ * (key % (par_num * SKEW_FINE_NUM)) of the other keys. the dpus count
+ * the s tuples with at least one matching r tuple, so a heavy key only needs
+ * one r tuple next to every s tuple: its s tuples are dealt round robin over
+ * s_pieces partitions and one r tuple of the key goes into each of them, the
+ * other r tuples of the key are left out. the heavy pieces, then the buckets
+ * largest first, go to the least loaded partition with room on both sides.
+ * the pieces are as small as the balance asks for, as large as a slot allows
+ * when they do not fit, and plan_skew() fails when that does not fit either.
+ * the slots are padded like the range partitions.
+ */
+
+#define SKEW_OVERSAMPLE 256   // samples of each relation per partition
+#define SKEW_FINE_NUM 16      // fine buckets per partition
+#define SKEW_HEADROOM_SHIFT 2 // 1/4 of every slot is left for the uneven pieces and buckets
+
+struct heavy_key {
+    tuple_key_t key;
+    uint32_t r_num;
+    uint32_t s_num;
+    uint32_t piece; // first partition of the key in piece_par
+    uint32_t s_pieces;
+    tuple_t r_tuple; // the r tuple of every piece, when r_num > 0
+};
+
+struct skew_plan {
+    uint32_t fine_num;
+    uint32_t *bucket_par; // partition of every fine bucket
+    struct heavy_key *heavy;
+    uint32_t heavy_num;
+    uint32_t *slot; // heavy index + 1, 0 is empty
+    uint32_t slot_bits;
+    uint32_t *piece_par;
+};
+
+static inline uint32_t skew_hash(tuple_key_t key, uint32_t bits)
+{
+    return (uint32_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+static inline const struct heavy_key *find_heavy(const struct skew_plan *plan, tuple_key_t key)
+{
+    uint32_t mask = (1u << plan->slot_bits) - 1;
+    for (uint32_t h = skew_hash(key, plan->slot_bits); plan->slot[h] != 0; h = (h + 1) & mask) {
+        if (plan->heavy[plan->slot[h] - 1].key == key) {
+            return &plan->heavy[plan->slot[h] - 1];
+        }
+    }
+    return NULL;
+}
+
+static void index_heavy_keys(struct skew_plan *plan)
+{
+    uint32_t mask = (1u << plan->slot_bits) - 1;
+    memset(plan->slot, 0, sizeof(uint32_t) << plan->slot_bits);
+    for (uint32_t i = 0; i < plan->heavy_num; i++) {
+        uint32_t h = skew_hash(plan->heavy[i].key, plan->slot_bits);
+        while (plan->slot[h] != 0) {
+            h = (h + 1) & mask;
+        }
+        plan->slot[h] = i + 1;
+    }
+}
+
+// least loaded partition whose taken[] is not stamp and whose r and s slots
+// still hold add_r and add_s more tuples, UINT32_MAX when none does
+static uint32_t least_loaded(const uint32_t *load_r, const uint32_t *load_s, uint32_t par_num, uint32_t par_size,
+    uint32_t add_r, uint32_t add_s, const uint32_t *taken, uint32_t stamp)
+{
+    uint32_t best = UINT32_MAX;
+    for (uint32_t p = 0; p < par_num; p++) {
+        if ((taken != NULL && taken[p] == stamp) || (uint64_t)load_r[p] + add_r > par_size
+            || (uint64_t)load_s[p] + add_s > par_size) {
+            continue;
+        }
+        if (best == UINT32_MAX || (uint64_t)load_r[p] + load_s[p] < (uint64_t)load_r[best] + load_s[best]) {
+            best = p;
+        }
+    }
+    return best;
+}
+
+static inline uint32_t div_ceil(uint64_t a, uint64_t b)
+{
+    return (uint32_t)((a + b - 1) / b);
+}
+
+struct skew_load {
+    uint32_t *r; // tuples of r per partition
+    uint32_t *s;
+    uint32_t *taken; // heavy index + 1 of the last key with a piece in the partition
+    uint32_t par_num;
+    uint32_t par_size;
+};
+
+// the pieces of every heavy key with at most cell_cap s tuples each, then the
+// buckets sorted by size, false when a piece or a bucket fits no slot
+static bool place_skew(struct skew_plan *plan, struct skew_load *load, uint64_t cell_cap, uint32_t thread_num,
+    const uint64_t *bucket, const uint32_t *bucket_r)
+{
+    uint32_t par_num = load->par_num, par_size = load->par_size;
+    memset(load->r, 0, par_num * sizeof(uint32_t));
+    memset(load->s, 0, par_num * sizeof(uint32_t));
+    memset(load->taken, 0, par_num * sizeof(uint32_t));
+
+    uint32_t piece = 0;
+    for (uint32_t i = 0; i < plan->heavy_num; i++) {
+        struct heavy_key *h = &plan->heavy[i];
+        h->piece = piece;
+        h->s_pieces = MAX(1, div_ceil(h->s_num, cell_cap));
+        if (h->s_pieces > par_num) {
+            return false;
+        }
+
+        // every thread deals its own chunk from the first piece on, one more tuple per thread at most
+        uint32_t cell_r = h->r_num > 0 ? 1 : 0;
+        uint32_t cell_s = div_ceil(h->s_num, h->s_pieces) + (h->s_pieces > 1 ? thread_num : 0);
+        for (uint32_t j = 0; j < h->s_pieces; j++) {
+            uint32_t p = least_loaded(load->r, load->s, par_num, par_size, cell_r, cell_s, load->taken, i + 1);
+            if (p == UINT32_MAX) {
+                return false;
+            }
+            load->taken[p] = i + 1;
+            load->r[p] += cell_r;
+            load->s[p] += cell_s;
+            plan->piece_par[piece++] = p;
+        }
+    }
+
+    for (uint32_t b = 0; b < plan->fine_num; b++) {
+        uint32_t id = (uint32_t)bucket[b];
+        uint32_t n_r = bucket_r[id], n_s = (uint32_t)(bucket[b] >> 32) - n_r;
+        uint32_t p = least_loaded(load->r, load->s, par_num, par_size, n_r, n_s, NULL, 0);
+        if (p == UINT32_MAX) {
+            return false;
+        }
+        load->r[p] += n_r;
+        load->s[p] += n_s;
+        plan->bucket_par[id] = p;
+    }
+    return true;
+}
+
+static int compare_heavy_load(const void *a, const void *b)
+{
+    const struct heavy_key *x = a, *y = b;
+    uint64_t lx = (uint64_t)x->r_num + x->s_num, ly = (uint64_t)y->r_num + y->s_num;
+    return (lx < ly) - (lx > ly);
+}
+
+static int compare_bucket_size(const void *a, const void *b)
+{
+    // a bucket is its size in the high half and its index in the low half
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x < y) - (x > y);
+}
+
+// plan par_num partitions of at most par_size tuples of r and of s each for
+// thread_num partitioning threads, false when the heavy key pieces and the
+// buckets do not fit. plan is to be destroyed either way
+bool plan_skew(const tuple_t *r, uint32_t num_r, const tuple_t *s, uint32_t num_s, uint32_t par_num, uint32_t par_size,
+    uint32_t thread_num, struct skew_plan *plan)
+{
+    uint32_t num = par_num * SKEW_OVERSAMPLE;
+    tuple_key_t *sample = malloc(num * 2 * sizeof(tuple_key_t));
+    assert(sample != NULL);
+    uint32_t sample_num = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        if (num_r > 0) {
+            sample[sample_num++] = r[rand() % num_r].key;
+        }
+        if (num_s > 0) {
+            sample[sample_num++] = s[rand() % num_s].key;
+        }
+    }
+    qsort(sample, sample_num, sizeof(tuple_key_t), compare_keys);
+
+    // heavy keys: at least SKEW_OVERSAMPLE / 2 hits, about a quarter of a partition
+    plan->heavy = malloc(par_num * 4 * sizeof(struct heavy_key));
+    assert(plan->heavy != NULL);
+    plan->heavy_num = 0;
+    for (uint32_t i = 0, j; i < sample_num; i = j) {
+        for (j = i + 1; j < sample_num && sample[j] == sample[i]; j++) {
+        }
+        if (j - i >= SKEW_OVERSAMPLE / 2) {
+            memset(&plan->heavy[plan->heavy_num], 0, sizeof(struct heavy_key));
+            plan->heavy[plan->heavy_num++].key = sample[i];
+        }
+    }
+    free(sample);
+
+    plan->slot_bits = 4;
+    while ((1u << plan->slot_bits) < plan->heavy_num * 2) {
+        plan->slot_bits++;
+    }
+    plan->slot = malloc(sizeof(uint32_t) << plan->slot_bits);
+    plan->fine_num = par_num * SKEW_FINE_NUM;
+    uint64_t *bucket = calloc(plan->fine_num, sizeof(uint64_t));
+    uint32_t *bucket_r = calloc(plan->fine_num, sizeof(uint32_t));
+    plan->piece_par = NULL;
+    plan->bucket_par = NULL;
+    assert(plan->slot != NULL && bucket != NULL && bucket_r != NULL);
+    index_heavy_keys(plan);
+
+    // exact sizes of the heavy keys and of the fine buckets of all other keys
+    for (uint32_t i = 0; i < num_r; i++) {
+        struct heavy_key *h = (struct heavy_key *)find_heavy(plan, r[i].key);
+        if (h != NULL) {
+            if (h->r_num++ == 0) {
+                h->r_tuple = r[i];
+            }
+        } else {
+            bucket[r[i].key % plan->fine_num] += 1ull << 32;
+            bucket_r[r[i].key % plan->fine_num]++;
+        }
+    }
+    for (uint32_t i = 0; i < num_s; i++) {
+        struct heavy_key *h = (struct heavy_key *)find_heavy(plan, s[i].key);
+        if (h != NULL) {
+            h->s_num++;
+        } else {
+            bucket[s[i].key % plan->fine_num] += 1ull << 32;
+        }
+    }
+    qsort(plan->heavy, plan->heavy_num, sizeof(struct heavy_key), compare_heavy_load);
+    index_heavy_keys(plan);
+
+    uint32_t *load_r = malloc(par_num * sizeof(uint32_t));
+    uint32_t *load_s = malloc(par_num * sizeof(uint32_t));
+    uint32_t *taken = malloc(par_num * sizeof(uint32_t));
+    plan->piece_par = malloc((plan->heavy_num * par_num + 1) * sizeof(uint32_t));
+    plan->bucket_par = malloc(plan->fine_num * sizeof(uint32_t));
+    assert(load_r != NULL && load_s != NULL && taken != NULL && plan->piece_par != NULL && plan->bucket_par != NULL);
+
+    for (uint32_t b = 0; b < plan->fine_num; b++) {
+        bucket[b] |= b;
+    }
+    qsort(bucket, plan->fine_num, sizeof(uint64_t), compare_bucket_size);
+
+    // a piece gets at most half of an average partition, as much as a slot
+    // holds when the smaller pieces do not fit
+    struct skew_load load = { .r = load_r, .s = load_s, .taken = taken, .par_num = par_num, .par_size = par_size };
+    uint64_t target = ((uint64_t)num_r + num_s + par_num - 1) / par_num;
+    uint64_t cell_max = par_size > thread_num ? par_size - thread_num : 1;
+    uint64_t side = MIN(cell_max, MAX(1, target / 2));
+    bool fit = place_skew(plan, &load, side, thread_num, bucket, bucket_r)
+        || (side < cell_max && place_skew(plan, &load, cell_max, thread_num, bucket, bucket_r));
+    if (!fit) {
+        fprintf(stderr, "skew plan: the heavy keys and the buckets do not fit %u partitions of %u tuples\n", par_num,
+            par_size);
+    }
+
+    free(load_r);
+    free(load_s);
+    free(taken);
+    free(bucket);
+    free(bucket_r);
+    return fit;
+}
+
+void destroy_skew_plan(struct skew_plan *plan)
+{
+    free(plan->bucket_par);
+    free(plan->heavy);
+    free(plan->slot);
+    free(plan->piece_par);
+}
+
+// largest partition over the average, r and s of a partition are the work of one tasklet
+double partition_imbalance(const uint32_t *r_count, const uint32_t *s_count, uint32_t par_num)
+{
+    uint64_t largest = 0, sum = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        largest = MAX(largest, (uint64_t)r_count[p] + s_count[p]);
+        sum += (uint64_t)r_count[p] + s_count[p];
+    }
+    return sum > 0 ? (double)largest * par_num / sum : 1;
+}
+
+/*
+ * parallel partitioning: every thread counts the tuples of its chunk per
+ * partition, the prefix sum over the threads gives every thread an exclusive
+ * range inside each partition slot, then every thread scatters its own chunk
+ */
+
+struct partition_context {
+    const tuple_t *a;
+    tuple_t *par;
+    uint32_t par_num;
+    const tuple_key_t *tree; // range splitters, key % par_num when NULL
+    uint32_t bits;
+    const struct skew_plan *plan; // skew-aware partitioning when not NULL
+    bool r_side;                  // heavy r tuples are left out, partition_slots() adds one per piece
+    uint32_t *deal;               // next piece of every heavy key
+    uint32_t begin;
+    uint32_t end;
+    uint32_t *offset; // par_num counters, then write offsets
+    pthread_t thread;
+};
+
+static inline uint32_t partition_id(const struct partition_context *ctx, tuple_key_t key)
+{
+    if (ctx->tree == NULL) {
+        return key % ctx->par_num;
+    }
+    uint32_t k = 1;
+    for (uint32_t l = 0; l < ctx->bits; l++) {
+        k = 2 * k + (key >= ctx->tree[k]);
+    }
+    return k - (1u << ctx->bits);
+}
+
+// partition of key under the skew plan, UINT32_MAX for a heavy r tuple
+static inline uint32_t skew_partition(const struct partition_context *ctx, tuple_key_t key)
+{
+    const struct skew_plan *plan = ctx->plan;
+    const struct heavy_key *h = find_heavy(plan, key);
+    if (h == NULL) {
+        return plan->bucket_par[key % plan->fine_num];
+    }
+    if (ctx->r_side) {
+        return UINT32_MAX;
+    }
+    return plan->piece_par[h->piece + ctx->deal[h - plan->heavy]++ % h->s_pieces];
+}
+
+static void *partition_histogram_thread(void *args)
+{
+    struct partition_context *ctx = (struct partition_context *)args;
+    memset(ctx->offset, 0, ctx->par_num * sizeof(uint32_t));
+    if (ctx->plan != NULL) {
+        memset(ctx->deal, 0, ctx->plan->heavy_num * sizeof(uint32_t));
+        for (uint32_t i = ctx->begin; i < ctx->end; i++) {
+            uint32_t par_id = skew_partition(ctx, ctx->a[i].key);
+            if (par_id != UINT32_MAX) {
+                ctx->offset[par_id]++;
+            }
+        }
+        return NULL;
+    }
+    for (uint32_t i = ctx->begin; i < ctx->end; i++) {
+        uint32_t par_id = partition_id(ctx, ctx->a[i].key);
+        assert(par_id < ctx->par_num);
+        ctx->offset[par_id]++;
+    }
+    return NULL;
+}
+
+static void *partition_scatter_thread(void *args)
+{
+    struct partition_context *ctx = (struct partition_context *)args;
+    if (ctx->plan != NULL) {
+        // the same deal as the histogram pass
+        memset(ctx->deal, 0, ctx->plan->heavy_num * sizeof(uint32_t));
+        for (uint32_t i = ctx->begin; i < ctx->end; i++) {
+            uint32_t par_id = skew_partition(ctx, ctx->a[i].key);
+            if (par_id != UINT32_MAX) {
+                ctx->par[ctx->offset[par_id]++] = ctx->a[i];
+            }
+        }
+        return NULL;
+    }
+    for (uint32_t i = ctx->begin; i < ctx->end; i++) {
+        uint32_t par_id = partition_id(ctx, ctx->a[i].key);
+        ctx->par[ctx->offset[par_id]++] = ctx->a[i];
+    }
+    return NULL;
+}
+
+// how gives par_num and the partitioning scheme. the slot of partition p
+// starts at par_off + p * par_size * 2, range and skew partitions fill the
+// tail of every slot after the partition with pad_key. count gets the size of
+// every partition when not NULL
+static void partition_slots(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_off, uint32_t par_size,
+    const struct partition_context *how, tuple_key_t pad_key, uint32_t thread_num, uint32_t *count)
+{
+    uint32_t par_num = how->par_num;
+    uint32_t heavy_num = how->plan != NULL ? how->plan->heavy_num : 0;
+    bool pad = how->tree != NULL || how->plan != NULL;
+    struct partition_context ctx[thread_num];
+    uint32_t *offset = malloc(thread_num * par_num * sizeof(uint32_t));
+    uint32_t *deal = malloc((thread_num * heavy_num + 1) * sizeof(uint32_t));
+    uint32_t *tail = calloc(par_num, sizeof(uint32_t)); // r tuples of heavy keys after the thread ranges
+    assert(offset != NULL && deal != NULL && tail != NULL);
+
+    const struct skew_plan *plan = how->plan;
+    for (uint32_t i = 0; how->r_side && i < heavy_num; i++) {
+        const struct heavy_key *h = &plan->heavy[i];
+        for (uint32_t j = 0; h->r_num > 0 && j < h->s_pieces; j++) {
+            tail[plan->piece_par[h->piece + j]]++;
+        }
+    }
+
+    for (uint32_t t = 0; t < thread_num; t++) {
+        ctx[t] = *how;
+        ctx[t].a = a;
+        ctx[t].par = par;
+        ctx[t].begin = (uint32_t)((uint64_t)size * t / thread_num);
+        ctx[t].end = (uint32_t)((uint64_t)size * (t + 1) / thread_num);
+        ctx[t].offset = &offset[t * par_num];
+        ctx[t].deal = &deal[t * heavy_num];
+        int err = pthread_create(&ctx[t].thread, NULL, partition_histogram_thread, &ctx[t]);
+        assert(err == 0);
+        (void)err;
+    }
+    for (uint32_t t = 0; t < thread_num; t++) {
+        pthread_join(ctx[t].thread, NULL);
+    }
+
+    uint32_t smallest = UINT32_MAX, largest = 0;
+    for (uint32_t p = 0; p < par_num; p++) {
+        uint32_t slot = par_off + p * par_size * 2;
+        uint32_t off = slot;
+        uint32_t end = slot + par_size;
+        for (uint32_t t = 0; t < thread_num; t++) {
+            uint32_t n = ctx[t].offset[p];
+            ctx[t].offset[p] = off;
+            off += n;
+        }
+        uint32_t n = tail[p];
+        tail[p] = off;
+        off += n;
+        assert(off <= end); // the partition overflows its slot
+        smallest = MIN(smallest, off - slot);
+        largest = MAX(largest, off - slot);
+        if (count != NULL) {
+            count[p] = off - slot;
+        }
+
+        tuple_t pad_tuple;
+        memset(&pad_tuple, 0, sizeof(pad_tuple));
+        pad_tuple.key = pad_key;
+        for (; pad && off < end; off++) {
+            par[off] = pad_tuple;
+        }
+    }
+
+    // one r tuple of every heavy key in each of its pieces
+    for (uint32_t i = 0; how->r_side && i < heavy_num; i++) {
+        const struct heavy_key *h = &plan->heavy[i];
+        for (uint32_t j = 0; h->r_num > 0 && j < h->s_pieces; j++) {
+            par[tail[plan->piece_par[h->piece + j]]++] = h->r_tuple;
+        }
+    }
+
+    for (uint32_t t = 0; t < thread_num; t++) {
+        int err = pthread_create(&ctx[t].thread, NULL, partition_scatter_thread, &ctx[t]);
+        assert(err == 0);
+        (void)err;
+    }
+    for (uint32_t t = 0; t < thread_num; t++) {
+        pthread_join(ctx[t].thread, NULL);
+    }
+
+    printf("partition: %s, smallest: %u, largest: %u, slot: %u\n",
+        how->plan != NULL ? "skew" : how->tree != NULL ? "range" : "hash", smallest, largest, par_size);
+    free(offset);
+    free(deal);
+    free(tail);
+}
+
+void partition_tuples_parallel(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num, uint32_t par_off, uint32_t par_size,
+    uint32_t thread_num)
+{
+    struct partition_context how = { .par_num = par_num };
+    partition_slots(a, size, par, par_off, par_size, &how, 0, thread_num, NULL);
+}
+
+void partition_tuples_range(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num, uint32_t par_off, uint32_t par_size,
+    const tuple_key_t *tree, uint32_t bits, tuple_key_t pad_key, uint32_t thread_num)
+{
+    struct partition_context how = { .par_num = par_num, .tree = tree, .bits = bits };
+    partition_slots(a, size, par, par_off, par_size, &how, pad_key, thread_num, NULL);
+}
+
+void partition_tuples_skew(tuple_t *a, uint32_t size, tuple_t *par, uint32_t par_num, uint32_t par_off, uint32_t par_size,
+    const struct skew_plan *plan, bool r_side, tuple_key_t pad_key, uint32_t thread_num, uint32_t *count)
+{
+    struct partition_context how = { .par_num = par_num, .plan = plan, .r_side = r_side };
+    partition_slots(a, size, par, par_off, par_size, &how, pad_key, thread_num, count);
+}
+
 static void allocated_and_compute(struct dpu_set_t dpu_set, uint32_t nr_ranks, algo_request_t *request, uint32_t nb_mram,
-    uint32_t nb_loop, bool load_mram)
+    uint32_t nb_loop, bool load_mram, uint32_t nb_thread, bool range, bool skew, double theta)
 {
     // Set dpu_offset
     uint32_t dpu_offset[nr_ranks];
@@ -348,14 +948,68 @@ static void allocated_and_compute(struct dpu_set_t dpu_set, uint32_t nr_ranks, a
 
     printf("dpu count: %u, tpules size: %u, tuples memory: %f MB\n", nb_mram, (uint32_t)TUPLES_NUM, (float)size / 1024 / 1024);
 
-    generate_dataset1(r, nb_mram * TUPLES_NUM);
-    generate_dataset1(s, nb_mram * TUPLES_NUM);
+    // range and skew partitions are not equal, leave room in every slot for the larger ones
+    uint32_t nb_tuples = nb_mram * TUPLES_NUM;
+    if (range) {
+        nb_tuples -= nb_tuples >> RANGE_HEADROOM_SHIFT;
+    } else if (skew) {
+        nb_tuples -= nb_tuples >> SKEW_HEADROOM_SHIFT;
+    }
+    if (theta > 0) {
+        generate_zipf(r, nb_tuples, theta);
+        generate_zipf(s, nb_tuples, theta);
+    } else {
+        generate_dataset1(r, nb_tuples);
+        generate_dataset1(s, nb_tuples);
+    }
 
-    tuple_t *par = malloc(nb_mram * MRAM_SIZE * 2);
+    tuple_t *par = malloc(nb_mram * TUPLES_NUM * sizeof(tuple_t) * 2);
     assert(par != NULL);
 
-    partition_tuples(r, nb_mram * TUPLES_NUM, par, nb_mram * NR_TASKLETS, 0, TUPLES_NUM / NR_TASKLETS);
-    partition_tuples(s, nb_mram * TUPLES_NUM, par, nb_mram * NR_TASKLETS, TUPLES_NUM / NR_TASKLETS, TUPLES_NUM / NR_TASKLETS);
+    uint32_t par_num = nb_mram * NR_TASKLETS;
+    uint32_t par_size = TUPLES_NUM_PER_TASKLET;
+    unsigned long long t = my_clock();
+    if (range) {
+        // s uses the splitters of r, the pad keys of r and s never match
+        uint32_t bits = 0;
+        while ((1u << bits) < par_num) {
+            bits++;
+        }
+        tuple_key_t *tree = malloc(sizeof(tuple_key_t) << bits);
+        assert(tree != NULL);
+        sample_splitters(r, nb_tuples, par_num, bits, tree);
+        partition_tuples_range(r, nb_tuples, par, par_num, 0, par_size, tree, bits, (tuple_key_t)-1, nb_thread);
+        partition_tuples_range(s, nb_tuples, par, par_num, par_size, par_size, tree, bits, (tuple_key_t)-2, nb_thread);
+        free(tree);
+    } else if (skew) {
+        uint32_t *r_count = calloc(par_num, sizeof(uint32_t));
+        uint32_t *s_count = calloc(par_num, sizeof(uint32_t));
+        assert(r_count != NULL && s_count != NULL);
+        for (uint32_t i = 0; i < nb_tuples; i++) {
+            r_count[r[i].key % par_num]++;
+            s_count[s[i].key % par_num]++;
+        }
+        printf("hash partition imbalance (largest / average): %.2f\n", partition_imbalance(r_count, s_count, par_num));
+
+        struct skew_plan plan;
+        if (!plan_skew(r, nb_tuples, s, nb_tuples, par_num, par_size, nb_thread, &plan)) {
+            fprintf(stderr, "the heavy keys do not fit the dpus, use less skew\n");
+            destroy_skew_plan(&plan);
+            exit(EXIT_FAILURE);
+        }
+        partition_tuples_skew(r, nb_tuples, par, par_num, 0, par_size, &plan, true, (tuple_key_t)-1, nb_thread, r_count);
+        partition_tuples_skew(
+            s, nb_tuples, par, par_num, par_size, par_size, &plan, false, (tuple_key_t)-2, nb_thread, s_count);
+        printf("skew partition imbalance (largest / average): %.2f, heavy keys: %u\n",
+            partition_imbalance(r_count, s_count, par_num), plan.heavy_num);
+        destroy_skew_plan(&plan);
+        free(r_count);
+        free(s_count);
+    } else {
+        partition_tuples_parallel(r, nb_tuples, par, par_num, 0, par_size, nb_thread);
+        partition_tuples_parallel(s, nb_tuples, par, par_num, par_size, par_size, nb_thread);
+    }
+    printf("partition threads: %u, time: %llu ns\n", nb_thread, my_clock() - t);
 
     if (load_mram) {
         printf("Preparing %u MRAMs \n", nb_mram);
@@ -437,16 +1091,20 @@ int main(int argc, char **argv)
 
     unsigned int nb_mram = DEFAULT_MRAM;
     unsigned int nb_loop = DEFAULT_LOOP;
+    unsigned int nb_thread = DEFAULT_THREAD;
     char *mram_path = DEFAULT_MRAM_PATH;
     bool load_mram = true;
-    parse_args(argc, argv, &nb_mram, &nb_loop, &load_mram, &mram_path);
+    bool range = false;
+    bool skew = false;
+    double theta = 0;
+    parse_args(argc, argv, &nb_mram, &nb_loop, &nb_thread, &load_mram, &range, &skew, &theta, &mram_path);
 
     printf("Allocating DPUs\n");
     DPU_ASSERT(dpu_alloc(nb_mram, "cycleAccurate=true", &dpu_set));
     DPU_ASSERT(dpu_load_from_incbin(dpu_set, &dpu_binary, NULL));
     DPU_ASSERT(dpu_get_nr_ranks(dpu_set, &nr_ranks));
     printf("alloc ranks: %u, type: %u\n", nr_ranks, dpu_set.kind);
-    allocated_and_compute(dpu_set, nr_ranks, &request, nb_mram, nb_loop, load_mram);
+    allocated_and_compute(dpu_set, nr_ranks, &request, nb_mram, nb_loop, load_mram, nb_thread, range, skew, theta);
 
     DPU_ASSERT(dpu_free(dpu_set));
 
@@ -0,0 +1,201 @@
+/*
+ * tuple kernels specialized at compile time for one key/value layout
+ *
+ * include once per layout with TUPLE_SUFFIX, TUPLE_KEY_T and TUPLE_VALUE_T
+ * defined, e.g. 64-bit keys with 16-byte payloads:
+ *
+ *     #define TUPLE_SUFFIX  816
+ *     #define TUPLE_KEY_T   uint64_t
+ *     #define TUPLE_VALUE_T tuple_payload16_t
+ *     #include "tuple_template.h"
+ *
+ * defines tuple_816_t with merge_816(), merge_sort_816(), merge_join_816(),
+ * partition_tuples_816() and friends. every instance copies and compares its
+ * own fixed-size type, nothing goes through a function pointer or a runtime
+ * tuple size in the inner loops.
+ */
+
+#ifndef TUPLE_TEMPLATE_H
+#define TUPLE_TEMPLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} tuple_payload16_t;
+
+#define TPL_CAT(a, b)  a##b
+#define TPL_XCAT(a, b) TPL_CAT(a, b)
+#define TPL(name)      TPL_XCAT(name##_, TUPLE_SUFFIX)
+#define TPL_T          TPL_XCAT(TPL(tuple), _t)
+
+#define TPL_SORT_BLOCK 16  // runs built by insertion sort before merging
+
+#endif // TUPLE_TEMPLATE_H
+
+#if !defined(TUPLE_SUFFIX) || !defined(TUPLE_KEY_T) || !defined(TUPLE_VALUE_T)
+#error "define TUPLE_SUFFIX, TUPLE_KEY_T and TUPLE_VALUE_T before including tuple_template.h"
+#endif
+
+typedef struct {
+    TUPLE_KEY_T   key;
+    TUPLE_VALUE_T value;
+} TPL_T;
+
+void TPL(merge)(TPL_T *a, uint32_t left, uint32_t mid, uint32_t right, TPL_T *tmp) {
+    uint32_t i = left;
+    uint32_t j = mid;
+    uint32_t k = left;
+
+    // branch free, the compare picks the source pointer
+    while (i < mid && j < right) {
+        bool take_j = a[j].key <= a[i].key;
+        tmp[k++] = *(take_j ? &a[j] : &a[i]);
+        j += take_j;
+        i += !take_j;
+    }
+
+    while (i < mid)
+        tmp[k++] = a[i++];
+
+    while (j < right)
+        tmp[k++] = a[j++];
+}
+
+void TPL(insertion_sort)(TPL_T *a, uint32_t len) {
+    for (uint32_t i = 1; i < len; i++) {
+        TPL_T t = a[i];
+        uint32_t j = i;
+        while (j > 0 && a[j - 1].key > t.key) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = t;
+    }
+}
+
+// non-recursive
+void TPL(merge_sort)(TPL_T *a, uint32_t len, TPL_T *tmp) {
+    if (len <= 1)
+        return;
+
+    for (uint32_t i = 0; i < len; i += TPL_SORT_BLOCK)
+        TPL(insertion_sort)(&a[i], len - i < TPL_SORT_BLOCK ? len - i : TPL_SORT_BLOCK);
+
+    uint32_t toggle = 0;
+    TPL_T *src, *dst;
+    for (uint32_t width = TPL_SORT_BLOCK; width < len; width <<= 1) {
+        if (toggle & 1) {
+            src = tmp;
+            dst = a;
+        }
+        else {
+            src = a;
+            dst = tmp;
+        }
+        for (uint32_t i = 0; i < len; i += (width << 1)) {
+            uint32_t mid = i + width;
+            if (mid > len)
+                mid = len;
+
+            uint32_t right = mid + width;
+            if (right > len)
+                right = len;
+
+            TPL(merge)(src, i, mid, right, dst);
+        }
+        toggle++;
+    }
+
+    if (toggle & 1)
+        memcpy(a, tmp, len * sizeof(TPL_T));
+}
+
+// count the matches of sorted r and s, equal key groups on both sides count
+// their full cross product like merge_join() in merge_sort.c
+uint64_t TPL(merge_join)(TPL_T *r, TPL_T *s, uint32_t num_r, uint32_t num_s, void *output) {
+    uint32_t i = 0, j = 0;
+    uint64_t matches = 0;
+    (void)output;
+
+    while (i < num_r && j < num_s) {
+        if (r[i].key < s[j].key)
+            i++;
+        else if (r[i].key > s[j].key)
+            j++;
+        else {
+            uint32_t ie = i + 1, je = j + 1;
+            while (ie < num_r && r[ie].key == r[i].key)
+                ie++;
+            while (je < num_s && s[je].key == s[j].key)
+                je++;
+            matches += (uint64_t)(ie - i) * (je - j);
+            i = ie;
+            j = je;
+        }
+    }
+
+    return matches;
+}
+
+void TPL(partition_tuples)(TPL_T *a, uint32_t size, TPL_T *par, uint32_t par_num, uint32_t par_off, uint32_t par_size) {
+    uint32_t offset[par_num];
+
+    for (uint32_t i = 0; i < par_num; i++) {
+        offset[i] = par_off + i * par_size;
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t par_id = a[i].key % par_num;
+        par[offset[par_id]] = a[i];
+        offset[par_id]++;
+    }
+}
+
+// partition r and s into par as pairs of par_size slots, then sort and join every pair
+uint64_t TPL(partition_sort_join)(TPL_T *r, TPL_T *s, uint32_t size, TPL_T *par,
+                                  uint32_t par_num, uint32_t par_size, TPL_T *tmp) {
+    uint64_t matches = 0;
+
+    TPL(partition_tuples)(r, size, par, par_num, 0, par_size * 2);
+    TPL(partition_tuples)(s, size, par, par_num, par_size, par_size * 2);
+
+    for (uint32_t i = 0; i < par_num; i++) {
+        uint32_t off = par_size * i * 2;
+        TPL(merge_sort)(&par[off], par_size, tmp);
+        TPL(merge_sort)(&par[off + par_size], par_size, tmp);
+        matches += TPL(merge_join)(&par[off], &par[off + par_size], par_size, par_size, NULL);
+    }
+
+    return matches;
+}
+
+// unique keys 0 .. size - 1 in random order, values zeroed
+void TPL(generate_tuples)(TPL_T *a, uint32_t size) {
+    memset(a, 0, size * sizeof(TPL_T));
+    for (uint32_t i = 0; i < size; i++)
+        a[i].key = i;
+
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t j = rand() % size;
+        TPL_T t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+bool TPL(is_tuples_sorted)(TPL_T *a, uint32_t size) {
+    for (uint32_t i = 1; i < size; i++) {
+        if (a[i - 1].key > a[i].key)
+            return false;
+    }
+
+    return true;
+}
+
+#undef TUPLE_SUFFIX
+#undef TUPLE_KEY_T
+#undef TUPLE_VALUE_T